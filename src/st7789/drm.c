@@ -0,0 +1,336 @@
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/version.h>
+
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_modes.h>
+#include <drm/drm_probe_helper.h>
+#include <drm/drm_simple_kms_helper.h>
+
+#include "lcd.h"
+
+/* The GEM CMA helpers were renamed to DMA helpers in 6.1 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#include <drm/drm_gem_dma_helper.h>
+#define st7789vfb_gem_object drm_gem_dma_object
+#define to_st7789vfb_gem_object to_drm_gem_dma_obj
+#define ST7789VFB_GEM_DRIVER_OPS DRM_GEM_DMA_DRIVER_OPS_VMAP
+#define DEFINE_ST7789VFB_GEM_FOPS DEFINE_DRM_GEM_DMA_FOPS
+#else
+#include <drm/drm_gem_cma_helper.h>
+#define st7789vfb_gem_object drm_gem_cma_object
+#define to_st7789vfb_gem_object to_drm_gem_cma_obj
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#define ST7789VFB_GEM_DRIVER_OPS DRM_GEM_CMA_DRIVER_OPS_VMAP
+#else
+#define ST7789VFB_GEM_DRIVER_OPS DRM_GEM_CMA_VMAP_DRIVER_OPS
+#endif
+#define DEFINE_ST7789VFB_GEM_FOPS DEFINE_DRM_GEM_CMA_FOPS
+#endif
+
+/* Simple pipes prepare GEM framebuffers by default since 5.14 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+#define ST7789VFB_PREPARE_FB NULL
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+#include <drm/drm_gem_atomic_helper.h>
+#define ST7789VFB_PREPARE_FB drm_gem_simple_display_pipe_prepare_fb
+#else
+#define ST7789VFB_PREPARE_FB drm_gem_fb_simple_display_pipe_prepare_fb
+#endif
+
+/* Imported dma-bufs are read through their kernel mapping */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+
+/*
+ * DRM front end: a single fixed mode pipe whose plane is copied into the
+ * vmem of the panel core, which then flushes it like fbdev damage. Buffers are
+ * dumb CMA buffers or imported dma-bufs, only the damaged rows are copied.
+ *
+ * Clients hand buffers over without copying them, but the kernel side is not
+ * zero copy: the damaged clips go through vmem once. The flush byte swaps
+ * vmem into the SPI buffers and keeps its row hashes and the fbdev view on
+ * it, so reading the GEM buffer directly would only move this copy there.
+ */
+struct st7789vfb_drm {
+	struct drm_device drm;
+	struct drm_simple_display_pipe pipe;
+	struct drm_connector connector;
+	struct drm_display_mode mode;
+	struct st7789vfb_par *par;
+};
+
+static inline struct st7789vfb_drm *to_st7789vfb_drm(struct drm_device *drm)
+{
+	return container_of(drm, struct st7789vfb_drm, drm);
+}
+
+static const u32 st7789vfb_drm_formats[] = {
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_XRGB8888,
+};
+
+static inline u16 st7789vfb_drm_xrgb8888_to_rgb565(u32 pixel)
+{
+	return ((pixel & 0xF80000) >> 8) | ((pixel & 0xFC00) >> 5) |
+	       ((pixel & 0xF8) >> 3);
+}
+
+/* Copy the clip of the framebuffer into vmem, converting it to RGB565 */
+static int st7789vfb_drm_copy(struct st7789vfb_drm *sdrm,
+			      struct drm_framebuffer *fb, struct drm_rect *clip)
+{
+	struct drm_gem_object *gem = drm_gem_fb_get_obj(fb, 0);
+	struct st7789vfb_gem_object *obj = to_st7789vfb_gem_object(gem);
+	struct dma_buf_attachment *import_attach = gem->import_attach;
+	unsigned int pitch;
+	u8 *vmem = st7789vfb_vmem(sdrm->par, &pitch);
+	const u8 *src;
+	u16 *dst;
+	unsigned int x, y;
+	int ret;
+
+	if (import_attach) {
+		ret = dma_buf_begin_cpu_access(import_attach->dmabuf,
+					       DMA_FROM_DEVICE);
+		if (ret)
+			return ret;
+	}
+
+	for (y = clip->y1; y < clip->y2; y++) {
+		src = obj->vaddr + fb->offsets[0] + y * fb->pitches[0];
+		dst = (u16 *)(vmem + y * pitch);
+
+		if (fb->format->format == DRM_FORMAT_RGB565) {
+			memcpy(dst + clip->x1, src + clip->x1 * 2,
+			       drm_rect_width(clip) * 2);
+			continue;
+		}
+
+		for (x = clip->x1; x < clip->x2; x++)
+			dst[x] = st7789vfb_drm_xrgb8888_to_rgb565(
+				((const u32 *)src)[x]);
+	}
+
+	ret = 0;
+	if (import_attach)
+		ret = dma_buf_end_cpu_access(import_attach->dmabuf,
+					     DMA_FROM_DEVICE);
+
+	return ret;
+}
+
+static void st7789vfb_drm_flush(struct st7789vfb_drm *sdrm,
+				struct drm_framebuffer *fb,
+				struct drm_rect *clip)
+{
+	int idx;
+	int ret;
+
+	if (!drm_dev_enter(&sdrm->drm, &idx))
+		return;
+
+	ret = st7789vfb_drm_copy(sdrm, fb, clip);
+	if (ret) {
+		dev_err_ratelimited(sdrm->drm.dev,
+				    "Failed to read framebuffer (%d)", ret);
+		goto exit;
+	}
+
+	st7789vfb_update_rect(sdrm->par, clip->x1, clip->y1,
+			      drm_rect_width(clip), drm_rect_height(clip));
+
+exit:
+	drm_dev_exit(idx);
+}
+
+static void st7789vfb_drm_enable(struct drm_simple_display_pipe *pipe,
+				 struct drm_crtc_state *crtc_state,
+				 struct drm_plane_state *plane_state)
+{
+	struct st7789vfb_drm *sdrm = to_st7789vfb_drm(pipe->crtc.dev);
+	struct drm_framebuffer *fb = plane_state->fb;
+	struct drm_rect rect = {
+		.x1 = 0,
+		.y1 = 0,
+		.x2 = fb->width,
+		.y2 = fb->height,
+	};
+	int idx;
+
+	if (!drm_dev_enter(&sdrm->drm, &idx))
+		return;
+
+	st7789vfb_drm_flush(sdrm, fb, &rect);
+	st7789vfb_power(sdrm->par, true);
+
+	drm_dev_exit(idx);
+}
+
+static void st7789vfb_drm_disable(struct drm_simple_display_pipe *pipe)
+{
+	struct st7789vfb_drm *sdrm = to_st7789vfb_drm(pipe->crtc.dev);
+	int idx;
+
+	if (!drm_dev_enter(&sdrm->drm, &idx))
+		return;
+
+	st7789vfb_power(sdrm->par, false);
+
+	drm_dev_exit(idx);
+}
+
+static void st7789vfb_drm_update(struct drm_simple_display_pipe *pipe,
+				 struct drm_plane_state *old_state)
+{
+	struct st7789vfb_drm *sdrm = to_st7789vfb_drm(pipe->crtc.dev);
+	struct drm_plane_state *state = pipe->plane.state;
+	struct drm_rect rect;
+
+	if (!pipe->crtc.state->active)
+		return;
+
+	/* FB_DAMAGE_CLIPS, or the whole plane when userspace gave none */
+	if (drm_atomic_helper_damage_merged(old_state, state, &rect))
+		st7789vfb_drm_flush(sdrm, state->fb, &rect);
+}
+
+static const struct drm_simple_display_pipe_funcs st7789vfb_drm_pipe_funcs = {
+	.enable = st7789vfb_drm_enable,
+	.disable = st7789vfb_drm_disable,
+	.update = st7789vfb_drm_update,
+	.prepare_fb = ST7789VFB_PREPARE_FB,
+};
+
+static int st7789vfb_drm_get_modes(struct drm_connector *connector)
+{
+	struct st7789vfb_drm *sdrm = to_st7789vfb_drm(connector->dev);
+	struct drm_display_mode *mode;
+
+	mode = drm_mode_duplicate(connector->dev, &sdrm->mode);
+	if (!mode)
+		return 0;
+
+	mode->type |= DRM_MODE_TYPE_PREFERRED;
+	drm_mode_probed_add(connector, mode);
+
+	return 1;
+}
+
+static const struct drm_connector_helper_funcs st7789vfb_drm_connector_hfuncs = {
+	.get_modes = st7789vfb_drm_get_modes,
+};
+
+static const struct drm_connector_funcs st7789vfb_drm_connector_funcs = {
+	.reset = drm_atomic_helper_connector_reset,
+	.fill_modes = drm_helper_probe_single_connector_modes,
+	.destroy = drm_connector_cleanup,
+	.atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
+};
+
+static const struct drm_mode_config_funcs st7789vfb_drm_mode_config_funcs = {
+	.fb_create = drm_gem_fb_create_with_dirty,
+	.atomic_check = drm_atomic_helper_check,
+	.atomic_commit = drm_atomic_helper_commit,
+};
+
+DEFINE_ST7789VFB_GEM_FOPS(st7789vfb_drm_fops);
+
+static struct drm_driver st7789vfb_drm_driver = {
+	.driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
+	.fops = &st7789vfb_drm_fops,
+	/* Imported dma-bufs get a kernel mapping, the copy reads through it */
+	ST7789VFB_GEM_DRIVER_OPS,
+	.name = "st7789vfb",
+	.desc = "Sitronix ST7789V",
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+	.date = "20261017",
+#endif
+	.major = 1,
+	.minor = 0,
+};
+
+struct st7789vfb_drm *st7789vfb_drm_init(struct st7789vfb_par *par,
+					 struct device *dev,
+					 unsigned int width,
+					 unsigned int height)
+{
+	struct st7789vfb_drm *sdrm;
+	struct drm_device *drm;
+	int ret;
+
+	/* CMA buffers need a DMA mask, SPI devices usually come without one */
+	if (!dev->coherent_dma_mask) {
+		ret = dma_coerce_mask_and_coherent(dev, DMA_BIT_MASK(32));
+		if (ret) {
+			dev_err(dev, "Failed to set DMA mask (%d)", ret);
+			return ERR_PTR(ret);
+		}
+	}
+
+	sdrm = devm_drm_dev_alloc(dev, &st7789vfb_drm_driver,
+				  struct st7789vfb_drm, drm);
+	if (IS_ERR(sdrm))
+		return sdrm;
+
+	drm = &sdrm->drm;
+	sdrm->par = par;
+	sdrm->mode = (struct drm_display_mode){
+		DRM_SIMPLE_MODE(width, height, 0, 0),
+	};
+
+	ret = drmm_mode_config_init(drm);
+	if (ret)
+		return ERR_PTR(ret);
+
+	drm->mode_config.min_width = width;
+	drm->mode_config.max_width = width;
+	drm->mode_config.min_height = height;
+	drm->mode_config.max_height = height;
+	drm->mode_config.preferred_depth = 16;
+	drm->mode_config.funcs = &st7789vfb_drm_mode_config_funcs;
+
+	drm_connector_helper_add(&sdrm->connector,
+				 &st7789vfb_drm_connector_hfuncs);
+	ret = drm_connector_init(drm, &sdrm->connector,
+				 &st7789vfb_drm_connector_funcs,
+				 DRM_MODE_CONNECTOR_SPI);
+	if (ret)
+		return ERR_PTR(ret);
+
+	ret = drm_simple_display_pipe_init(drm, &sdrm->pipe,
+					   &st7789vfb_drm_pipe_funcs,
+					   st7789vfb_drm_formats,
+					   ARRAY_SIZE(st7789vfb_drm_formats),
+					   NULL, &sdrm->connector);
+	if (ret)
+		return ERR_PTR(ret);
+
+	drm_plane_enable_fb_damage_clips(&sdrm->pipe.plane);
+
+	drm_mode_config_reset(drm);
+
+	ret = drm_dev_register(drm, 0);
+	if (ret)
+		return ERR_PTR(ret);
+
+	return sdrm;
+}
+
+void st7789vfb_drm_fini(struct st7789vfb_drm *sdrm)
+{
+	/* The device may outlive the panel core while userspace holds it */
+	drm_dev_unplug(&sdrm->drm);
+	drm_atomic_helper_shutdown(&sdrm->drm);
+}
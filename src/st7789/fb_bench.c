@@ -0,0 +1,641 @@
+/*
+ * Throughput and latency benchmark for st7789vfb.
+ *
+ * Drives the framebuffer with a set of workloads and reports for each one the
+ * rate the client drew at, the rate the driver flushed at, how long each frame
+ * took the client, how long damage waited for its flush (from the debugfs
+ * latency_us histogram), how many flushes missed their frame and the CPU
+ * time spent. To run it without a panel, put the stand-in SPI controller
+ * under the driver first, its device binds through the st7789bfb id:
+ *
+ *	make modules app
+ *	insmod st7789vfb.ko
+ *	insmod st7789_dummy.ko speed_hz=32000000
+ *	./fb_bench -f /dev/fb0 -t 5
+ *
+ * The dummy controller paces transfers at speed_hz, so runs against it are
+ * comparable from one build to the next and serve as the regression baseline.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <linux/fb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "st7789vfb.h"
+
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, uint32_t)
+#endif
+
+#define MAX_BUCKETS 32
+
+struct bench {
+	int fd;
+	int console;
+	char debugfs[256];
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	uint8_t *vmem;
+	uint8_t *untracked;
+	uint8_t *buf;
+	size_t size;
+	double duration;
+	unsigned int rate;
+	int sync;
+};
+
+struct workload {
+	const char *name;
+	const char *desc;
+	int (*frame)(struct bench *b, unsigned int n);
+};
+
+struct driver_stats {
+	unsigned long long frames_flushed;
+	unsigned long long frames_coalesced;
+	unsigned long long deadline_misses;
+	unsigned long long bytes_flushed;
+	unsigned long long spi_errors;
+	unsigned long long low[MAX_BUCKETS];
+	unsigned long long count[MAX_BUCKETS];
+	int nbuckets;
+};
+
+struct cpu_sample {
+	struct rusage self;
+	unsigned long long busy;
+	unsigned long long total;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t pattern(unsigned int n, unsigned int y)
+{
+	return (uint16_t)((n * 2654435761u) ^ (y * 40503u));
+}
+
+static void fill16(uint8_t *dst, uint16_t color, size_t len)
+{
+	uint16_t *p = (uint16_t *)dst;
+	size_t i;
+
+	for (i = 0; i < len / 2; i++)
+		p[i] = color;
+}
+
+/* Workloads, each draws frame n */
+
+static int write_full(struct bench *b, unsigned int n)
+{
+	unsigned int y;
+
+	for (y = 0; y < b->var.yres; y++)
+		fill16(b->buf + y * b->fix.line_length, pattern(n, y),
+		       b->fix.line_length);
+
+	return pwrite(b->fd, b->buf, b->size, 0) < 0 ? -errno : 0;
+}
+
+static int write_partial(struct bench *b, unsigned int n)
+{
+	unsigned int lines = 16;
+	unsigned int y = (n * 37) % (b->var.yres - lines);
+	size_t len = lines * b->fix.line_length;
+
+	fill16(b->buf, pattern(n, y), len);
+
+	return pwrite(b->fd, b->buf, len, y * b->fix.line_length) < 0 ?
+		       -errno :
+		       0;
+}
+
+static int write_small(struct bench *b, unsigned int n)
+{
+	size_t len = 32;
+	size_t offset = ((size_t)rand() % (b->size / len)) * len;
+
+	fill16(b->buf, pattern(n, 0), len);
+
+	return pwrite(b->fd, b->buf, len, offset) < 0 ? -errno : 0;
+}
+
+static int mmap_full(struct bench *b, unsigned int n)
+{
+	unsigned int y;
+
+	for (y = 0; y < b->var.yres; y++)
+		fill16(b->vmem + y * b->fix.line_length, pattern(n, y),
+		       b->fix.line_length);
+
+	return 0;
+}
+
+static int mmap_band(struct bench *b, unsigned int n)
+{
+	unsigned int lines = 32;
+	unsigned int y = (n * 7) % (b->var.yres - lines);
+
+	fill16(b->vmem + y * b->fix.line_length, pattern(n, y),
+	       lines * b->fix.line_length);
+
+	return 0;
+}
+
+static int mmap_dirty(struct bench *b, unsigned int n)
+{
+	unsigned int lines = 32;
+	unsigned int y = (n * 7) % (b->var.yres - lines);
+	struct st7789vfb_dirty_rect rect = {
+		.y = y,
+		.width = b->var.xres,
+		.height = lines,
+	};
+	struct st7789vfb_dirty dirty = {
+		.rects = (uintptr_t)&rect,
+		.nrects = 1,
+		.flags = b->sync ? ST7789VFB_DIRTY_WAIT : 0,
+	};
+
+	/* Like mmap-band, but untracked and reported to the driver */
+	fill16(b->untracked + y * b->fix.line_length, pattern(n, y),
+	       lines * b->fix.line_length);
+
+	return ioctl(b->fd, ST7789VFB_IOCTL_DIRTY, &dirty) < 0 ? -errno : 0;
+}
+
+static int mmap_sparse(struct bench *b, unsigned int n)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t offset;
+
+	/* One pixel in every fourth page, worst case for page tracking */
+	for (offset = (n % 4) * page; offset < b->size; offset += 4 * page)
+		fill16(b->vmem + offset, pattern(n, offset), 2);
+
+	return 0;
+}
+
+static int mmap_same(struct bench *b, unsigned int n)
+{
+	unsigned int y;
+
+	(void)n;
+
+	/* Same pixels every frame, only content hashing can tell */
+	for (y = 0; y < b->var.yres; y++)
+		fill16(b->vmem + y * b->fix.line_length, pattern(0, y),
+		       b->fix.line_length);
+
+	return 0;
+}
+
+static int pan(struct bench *b, unsigned int yoffset)
+{
+	struct fb_var_screeninfo var = b->var;
+
+	var.yoffset = yoffset;
+	return ioctl(b->fd, FBIOPAN_DISPLAY, &var) < 0 ? -errno : 0;
+}
+
+static int mmap_flip(struct bench *b, unsigned int n)
+{
+	unsigned int back = n & 1 ? 0 : b->var.yres;
+	unsigned int lines = 32;
+	unsigned int band = (n * 7) % (b->var.yres - lines);
+	uint8_t *line;
+	unsigned int y;
+
+	/* Whole frames into the hidden half, a box moving over a still one */
+	for (y = 0; y < b->var.yres; y++) {
+		line = b->vmem + (back + y) * b->fix.line_length;
+		fill16(line, pattern(0, y), b->fix.line_length);
+		if (y >= band && y < band + lines)
+			fill16(line, pattern(n, y), b->fix.line_length / 4);
+	}
+
+	return pan(b, back);
+}
+
+static int console_text(struct bench *b, unsigned int n)
+{
+	char line[96];
+	int len;
+
+	len = snprintf(line, sizeof(line),
+		       "%08u the quick brown fox jumps over the lazy dog %08x\n",
+		       n, n * 2654435761u);
+
+	return write(b->console, line, len) < 0 ? -errno : 0;
+}
+
+static const struct workload workloads[] = {
+	{ "write-full", "write() of the whole screen", write_full },
+	{ "write-partial", "write() of 16 lines at moving offsets",
+	  write_partial },
+	{ "write-small", "write() of 32 bytes at random offsets",
+	  write_small },
+	{ "mmap-full", "stores to the whole screen", mmap_full },
+	{ "mmap-band", "stores to a moving 32 line band", mmap_band },
+	{ "mmap-dirty", "mmap-band untracked, with the dirty ioctl",
+	  mmap_dirty },
+	{ "mmap-sparse", "one store in every fourth page", mmap_sparse },
+	{ "mmap-same", "whole screen rewritten unchanged", mmap_same },
+	{ "mmap-flip", "whole frames flipped to with FBIOPAN_DISPLAY",
+	  mmap_flip },
+	{ "console", "text lines through fbcon, needs -c", console_text },
+};
+
+/* Driver side statistics from debugfs */
+
+static int debugfs_write(struct bench *b, const char *file, const char *val)
+{
+	char path[512];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", b->debugfs, file);
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+	fputs(val, f);
+	fclose(f);
+
+	return 0;
+}
+
+static unsigned long long debugfs_read_u64(struct bench *b, const char *file)
+{
+	unsigned long long val = 0;
+	char path[512];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", b->debugfs, file);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%llu", &val) != 1)
+		val = 0;
+	fclose(f);
+
+	return val;
+}
+
+static void read_driver_stats(struct bench *b, struct driver_stats *st)
+{
+	unsigned long long low, count;
+	char path[512];
+	char line[128];
+	FILE *f;
+
+	memset(st, 0, sizeof(*st));
+	if (!b->debugfs[0])
+		return;
+
+	st->frames_flushed = debugfs_read_u64(b, "frames_flushed");
+	st->frames_coalesced = debugfs_read_u64(b, "frames_coalesced");
+	st->deadline_misses = debugfs_read_u64(b, "deadline_misses");
+	st->bytes_flushed = debugfs_read_u64(b, "bytes_flushed");
+	st->spi_errors = debugfs_read_u64(b, "spi_errors");
+
+	snprintf(path, sizeof(path), "%s/latency_us", b->debugfs);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f) && st->nbuckets < MAX_BUCKETS) {
+		/* "low-high: count", the last bucket has no high */
+		if (sscanf(line, "%llu-%*[0-9]: %llu", &low, &count) != 2 &&
+		    sscanf(line, "%llu-: %llu", &low, &count) != 2)
+			continue;
+		st->low[st->nbuckets] = low;
+		st->count[st->nbuckets] = count;
+		st->nbuckets++;
+	}
+	fclose(f);
+}
+
+/* Upper bound of the histogram bucket holding percentile p */
+static unsigned long long hist_percentile(const struct driver_stats *st,
+					  double p)
+{
+	unsigned long long total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < st->nbuckets; i++)
+		total += st->count[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < st->nbuckets; i++) {
+		seen += st->count[i];
+		if (seen >= p * total)
+			return st->low[i] ? st->low[i] * 2 - 1 : 0;
+	}
+
+	return st->low[st->nbuckets - 1] * 2 - 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double *v, size_t n, double p)
+{
+	size_t i;
+
+	if (!n)
+		return 0;
+	i = (size_t)(p * (n - 1) + 0.5);
+	return v[i];
+}
+
+static void cpu_sample(struct cpu_sample *s)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f;
+	int i;
+
+	getrusage(RUSAGE_SELF, &s->self);
+
+	s->busy = s->total = 0;
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0],
+		   &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) == 8) {
+		for (i = 0; i < 8; i++)
+			s->total += v[i];
+		/* Everything but idle and iowait */
+		s->busy = s->total - v[3] - v[4];
+	}
+	fclose(f);
+}
+
+static double tv_ms(const struct timeval *tv)
+{
+	return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+static void settle(struct bench *b)
+{
+	uint32_t crtc = 0;
+
+	/* Let the deferred flush run, then wait for the bus to go idle */
+	usleep(250000);
+	ioctl(b->fd, FBIO_WAITFORVSYNC, &crtc);
+}
+
+static int run(struct bench *b, const struct workload *w)
+{
+	size_t max = (size_t)(b->duration * (b->rate ? b->rate : 10000)) + 1;
+	double *lat = calloc(max, sizeof(*lat));
+	struct driver_stats st;
+	struct cpu_sample c0, c1;
+	struct timespec next;
+	double start, end, t0, elapsed, cpu_ms, sys_pct;
+	size_t n = 0;
+	int err = 0;
+
+	if (!lat)
+		return -ENOMEM;
+
+	if (b->debugfs[0])
+		debugfs_write(b, "reset", "1");
+
+	cpu_sample(&c0);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	start = now();
+	while (n < max && now() - start < b->duration) {
+		t0 = now();
+		err = w->frame(b, n);
+		if (err)
+			break;
+		if (b->sync && b->vmem && fsync(b->fd) < 0) {
+			err = -errno;
+			break;
+		}
+		lat[n++] = now() - t0;
+
+		if (b->rate) {
+			next.tv_nsec += 1000000000L / b->rate;
+			if (next.tv_nsec >= 1000000000L) {
+				next.tv_nsec -= 1000000000L;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+					NULL);
+		}
+	}
+	end = now();
+	elapsed = end - start;
+	settle(b);
+	cpu_sample(&c1);
+	read_driver_stats(b, &st);
+
+	if (err) {
+		fprintf(stderr, "%s: %s\n", w->name, strerror(-err));
+		free(lat);
+		return err;
+	}
+
+	qsort(lat, n, sizeof(*lat), cmp_double);
+	cpu_ms = tv_ms(&c1.self.ru_utime) - tv_ms(&c0.self.ru_utime) +
+		 tv_ms(&c1.self.ru_stime) - tv_ms(&c0.self.ru_stime);
+	sys_pct = c1.total > c0.total ? 100.0 * (c1.busy - c0.busy) /
+						(c1.total - c0.total) :
+					0;
+
+	printf("%-14s %7.1f %7.1f %6llu %8.2f %8.0f %8.0f %8.0f %8llu %8llu %6llu %8.0f %6.1f\n",
+	       w->name, n / elapsed, st.frames_flushed / elapsed,
+	       st.frames_coalesced, st.bytes_flushed / elapsed / 1e6,
+	       percentile(lat, n, 0.5) * 1e6, percentile(lat, n, 0.99) * 1e6,
+	       lat[n ? n - 1 : 0] * 1e6, hist_percentile(&st, 0.5),
+	       hist_percentile(&st, 0.99), st.deadline_misses, cpu_ms,
+	       sys_pct);
+
+	if (st.spi_errors)
+		printf("%-14s %llu SPI errors\n", "", st.spi_errors);
+
+	free(lat);
+	return 0;
+}
+
+static void find_debugfs(struct bench *b)
+{
+	glob_t g;
+
+	if (b->debugfs[0])
+		return;
+
+	if (glob("/sys/kernel/debug/st7789vfb-*", 0, NULL, &g))
+		return;
+	if (g.gl_pathc > 1)
+		fprintf(stderr, "several panels, using %s (see -D)\n",
+			g.gl_pathv[0]);
+	snprintf(b->debugfs, sizeof(b->debugfs), "%s", g.gl_pathv[0]);
+	globfree(&g);
+}
+
+static void usage(const char *prog)
+{
+	size_t i;
+
+	fprintf(stderr,
+		"Usage: %s [-f fb] [-D debugfs dir] [-c console tty] [-t seconds]\n"
+		"          [-r fps] [-s] [workload...]\n"
+		"  -r  draw at this rate instead of as fast as possible\n"
+		"  -s  fsync after every frame, write() does not wait for the panel\n"
+		"Workloads:\n",
+		prog);
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		fprintf(stderr, "  %-14s %s\n", workloads[i].name,
+			workloads[i].desc);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = { .duration = 5, .console = -1 };
+	const char *fb = "/dev/fb0";
+	const char *console = NULL;
+	size_t i;
+	int opt, j;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "f:D:c:t:r:sh")) != -1) {
+		switch (opt) {
+		case 'f':
+			fb = optarg;
+			break;
+		case 'D':
+			snprintf(b.debugfs, sizeof(b.debugfs), "%s", optarg);
+			break;
+		case 'c':
+			console = optarg;
+			break;
+		case 't':
+			b.duration = atof(optarg);
+			break;
+		case 'r':
+			b.rate = atoi(optarg);
+			break;
+		case 's':
+			b.sync = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	b.fd = open(fb, O_RDWR);
+	if (b.fd < 0) {
+		perror(fb);
+		return 1;
+	}
+
+	if (ioctl(b.fd, FBIOGET_VSCREENINFO, &b.var) < 0 ||
+	    ioctl(b.fd, FBIOGET_FSCREENINFO, &b.fix) < 0) {
+		perror("FBIOGET_*SCREENINFO");
+		return 1;
+	}
+	b.size = b.fix.line_length * b.var.yres;
+
+	b.buf = malloc(b.size);
+	b.vmem = mmap(NULL, b.fix.smem_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, b.fd, 0);
+	if (!b.buf || b.vmem == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	b.untracked = mmap(NULL, b.fix.smem_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, b.fd, ST7789VFB_MMAP_UNTRACKED);
+	if (b.untracked == MAP_FAILED)
+		b.untracked = NULL;
+
+	if (console) {
+		b.console = open(console, O_WRONLY | O_NOCTTY);
+		if (b.console < 0)
+			perror(console);
+	}
+
+	find_debugfs(&b);
+	if (!b.debugfs[0])
+		fprintf(stderr, "no debugfs directory, driver columns are 0\n");
+
+	printf("%s: %ux%u, %u bpp, %.0f s per workload%s\n", fb, b.var.xres,
+	       b.var.yres, b.var.bits_per_pixel, b.duration,
+	       b.sync ? ", fsync" : "");
+	printf("%-14s %7s %7s %6s %8s %8s %8s %8s %8s %8s %6s %8s %6s\n",
+	       "workload", "draw/s", "flush/s", "merged", "MB/s", "p50 us",
+	       "p99 us", "max us", "dmg p50", "dmg p99", "late", "cpu ms",
+	       "sys %");
+
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		const struct workload *w = &workloads[i];
+
+		if (optind < argc) {
+			for (j = optind; j < argc; j++) {
+				if (!strcmp(argv[j], w->name))
+					break;
+			}
+			if (j == argc)
+				continue;
+		}
+
+		if (w->frame == console_text && b.console < 0) {
+			if (optind < argc)
+				fprintf(stderr, "%s: needs -c\n", w->name);
+			continue;
+		}
+
+		if (w->frame == mmap_dirty && !b.untracked) {
+			if (optind < argc)
+				fprintf(stderr, "%s: no untracked mapping\n",
+					w->name);
+			continue;
+		}
+
+		if (w->frame == mmap_flip &&
+		    b.var.yres_virtual < 2 * b.var.yres) {
+			if (optind < argc)
+				fprintf(stderr, "%s: no second buffer\n",
+					w->name);
+			continue;
+		}
+
+		if (run(&b, w))
+			ret = 1;
+
+		/* The other workloads draw into the first buffer */
+		if (w->frame == mmap_flip)
+			pan(&b, 0);
+	}
+
+	munmap(b.vmem, b.fix.smem_len);
+	if (b.untracked)
+		munmap(b.untracked, b.fix.smem_len);
+	free(b.buf);
+	if (b.console >= 0)
+		close(b.console);
+	close(b.fd);
+
+	return ret;
+}
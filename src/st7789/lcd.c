@@ -1,16 +1,31 @@
 #include <linux/backlight.h>
+#include <linux/compat.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/errno.h>
 #include <linux/fb.h>
 #include <linux/gpio/consumer.h>
+#include <linux/interrupt.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/property.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <video/mipi_display.h>
 
+#include <asm/unaligned.h>
+
+#include "lcd.h"
+#include "st7789vfb.h"
+#define CREATE_TRACE_POINTS
+#include "st7789vfb_trace.h"
 #include "version.h"
 
 #define DRV_NAME "st7789vfb"
@@ -20,10 +35,91 @@
 #define SCREEN_BPP 16
 #define SCREEN_FPS 24
 
+/*
+ * vmem is two screens tall: hardware scrolling wraps over it, and apps flip
+ * between the halves
+ */
+#define SCREEN_YRES_VIRTUAL (SCREEN_HEIGHT * 2)
+
+/*
+ * Bus time a window costs on top of its pixels, in bytes of pixel data: three
+ * commands with parameters, each a DC switch and two message completions.
+ * Dirty rectangles are merged when the window around them wastes less.
+ */
+#define ST7789VFB_WINDOW_COST 1024
+#define ST7789VFB_MAX_RECTS 16
+
+/* Column blocks a GRAM row is hashed in, what changed is sent from these */
+#define ST7789VFB_HASH_BLOCKS 8
+
+/* Frames in flight, one on the bus while the next one is prepared */
+#define ST7789VFB_FRAMES 2
+#define ST7789VFB_MAX_SEGS 128
+#define ST7789VFB_MAX_XFERS 160
+#define ST7789VFB_CMDBUF_SIZE 512
+
+/* Words of the buffer commands sent one at a time go through without DC */
+#define ST7789VFB_BUF9_WORDS 16
+/* Shadow value of a register the controller state is unknown for */
+#define ST7789VFB_REG_UNKNOWN 0xFF
+
+/* Solid fills waiting for a flush, and their per-frame colour buffers */
+#define ST7789VFB_MAX_FILLS 8
+#define ST7789VFB_FILL_CHUNK 4096
+
+/* Console text runs per flush, the pool holding their 1 bit images */
+#define ST7789VFB_MAX_TEXTS 16
+#define ST7789VFB_TEXT_POOL 4096
+/* Colour pairs the glyph cache holds expansions for */
+#define ST7789VFB_GLYPH_PAIRS 4
+
+/*
+ * Wire pixel format, selected through var.nonstd. vmem is RGB565 either way,
+ * RGB444 packs two pixels in three bytes and saves a quarter of the bus time.
+ */
+#define ST7789VFB_NONSTD_RGB565 1
+#define ST7789VFB_NONSTD_RGB444 2
+
+/* Bounds of the flush rate, the panel itself refreshes at 60Hz */
+#define ST7789VFB_FPS_MIN 5
+#define ST7789VFB_FPS_MAX 60
+
+/* Longest wait for a tearing effect pulse, a few panel refreshes at 60Hz */
+#define ST7789VFB_TE_TIMEOUT msecs_to_jiffies(50)
+
+/* Share of a shared SPI controller, a panel gets priority + 1 shares */
+#define ST7789VFB_PRIO_MAX 7
+#define ST7789VFB_PRIO_DEFAULT 3
+
+/* log2 histograms in debugfs, the last bucket is open ended */
+#define ST7789VFB_HIST_BUCKETS 24
+
 static bool init = true;
 module_param(init, bool, 0);
 MODULE_PARM_DESC(init, "Set to zero to bypass chip initialization");
 
+static uint fps = SCREEN_FPS;
+module_param(fps, uint, 0444);
+MODULE_PARM_DESC(fps, "Default flush rate in frames per second");
+
+static bool adaptive;
+module_param(adaptive, bool, 0444);
+MODULE_PARM_DESC(adaptive, "Adapt the flush rate to the damage and bus load");
+
+static bool kms;
+module_param(kms, bool, 0444);
+MODULE_PARM_DESC(kms, "Register a DRM/KMS device instead of a framebuffer");
+
+static bool flush_wq;
+module_param(flush_wq, bool, 0444);
+MODULE_PARM_DESC(flush_wq,
+		 "Flush from a high priority workqueue per panel instead of the shared one");
+
+static int flush_cpu = -1;
+module_param(flush_cpu, int, 0444);
+MODULE_PARM_DESC(flush_cpu,
+		 "CPU the flush workqueues are bound to, -1 for unbound");
+
 enum st7789vfb_cmd {
 	PORCTRL = 0xB2,
 	GCTRL = 0xB7,
@@ -39,19 +135,216 @@ enum st7789vfb_cmd {
 	NVGAMCTRL = 0xE1,
 };
 
+#define ST7789VFB_MADCTL_MY BIT(7)
+#define ST7789VFB_MADCTL_MX BIT(6)
+#define ST7789VFB_MADCTL_MV BIT(5)
+
+/* Address mode for each FB_ROTATE_*, the controller does the rotation */
+static const u8 st7789vfb_madctl[] = {
+	[FB_ROTATE_UR] = 0,
+	[FB_ROTATE_CW] = ST7789VFB_MADCTL_MX | ST7789VFB_MADCTL_MV,
+	[FB_ROTATE_UD] = ST7789VFB_MADCTL_MX | ST7789VFB_MADCTL_MY,
+	[FB_ROTATE_CCW] = ST7789VFB_MADCTL_MY | ST7789VFB_MADCTL_MV,
+};
+
+enum st7789vfb_kind {
+	ST7789VFB_CMD = 0,
+	ST7789VFB_DATA = 1,
+};
+
+struct st7789vfb_frame;
+
+struct st7789vfb_seg {
+	struct spi_message msg;
+	struct st7789vfb_frame *frame;
+	enum st7789vfb_kind kind;
+};
+
+struct st7789vfb_frame {
+	struct st7789vfb_par *par;
+	struct st7789vfb_seg segs[ST7789VFB_MAX_SEGS];
+	struct spi_transfer xfers[ST7789VFB_MAX_XFERS];
+	u8 *cmdbuf;
+	u8 *txbuf;
+	unsigned int txlen;
+	u8 *fillbuf;
+	unsigned int nsegs;
+	unsigned int nxfers;
+	unsigned int cmdlen;
+	unsigned int nfills;
+	unsigned int next;
+	int status;
+	ktime_t start;
+	struct completion done;
+};
+
+/* Dirty area of vmem, in pixels and lines */
+struct st7789vfb_rect {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
+struct st7789vfb_fill {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+	u16 color;
+};
+
+/* Console text run: the 1 bit image fbcon drew, rendered again at flush time */
+struct st7789vfb_text {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+	u16 fg;
+	u16 bg;
+	/* Of the image in the text pool, rows padded to whole bytes */
+	unsigned int offset;
+};
+
+/* Every byte of a 1 bit image as 8 pixels on the wire, for one colour pair */
+struct st7789vfb_glyphs {
+	bool valid;
+	u16 fg;
+	u16 bg;
+	__be16 pixels[256][8];
+};
+
+/* Everything the next flush has to send, collected by the damage sources */
+struct st7789vfb_damage {
+	struct st7789vfb_rect rects[ST7789VFB_MAX_RECTS];
+	unsigned int nrects;
+	struct st7789vfb_fill fills[ST7789VFB_MAX_FILLS];
+	unsigned int nfills;
+	struct st7789vfb_text texts[ST7789VFB_MAX_TEXTS];
+	unsigned int ntexts;
+	u8 *pool;
+	unsigned int pool_len;
+	unsigned int yoffset;
+	bool scroll;
+	/* Updates merged into this flush, and when the first one came in */
+	unsigned int updates;
+	ktime_t since;
+};
+
+/* Bucket i counts values in [2^(i-1), 2^i) */
+struct st7789vfb_hist {
+	u64 count[ST7789VFB_HIST_BUCKETS];
+};
+
+/*
+ * Panels on one SPI controller take turns frame by frame. The next turn goes
+ * to the waiting panel that used the least bus time, scaled down by its
+ * shares, so a busy panel can't starve the others.
+ */
+struct st7789vfb_bus {
+	struct list_head node;
+	struct spi_master *master;
+	unsigned int refs;
+	spinlock_t lock;
+	struct list_head waiters;
+	bool busy;
+	u64 vclock;
+};
+
 struct st7789vfb_par {
 	struct gpio_desc *pin_bl;
 	struct gpio_desc *pin_dc;
 	struct gpio_desc *pin_pwr;
 	struct gpio_desc *pin_rst;
+	struct gpio_desc *pin_te;
+	/* Requested only while pin_te is set, freed before par goes */
+	int te_irq;
 	struct fb_info *info;
 	struct spi_device *spi;
+	struct dentry *debugfs;
+	struct mutex lock;
+	struct st7789vfb_frame *frames[ST7789VFB_FRAMES];
+	unsigned int cur_frame;
+	size_t max_xfer;
+	size_t txbuf_size;
+	/* Damage reported by the drawing ops, taken by the next flush */
+	spinlock_t damage_lock;
+	struct st7789vfb_damage damage;
+	/* Damage taken from the above and being sent, owned by the flush */
+	struct st7789vfb_damage flushing;
+	/* vmem line shown at the top of the panel, owned by the flush */
+	unsigned int yoffset;
+	/* Hash of what each GRAM row was last sent, owned by the flush */
+	u32 row_hash[SCREEN_HEIGHT][ST7789VFB_HASH_BLOCKS];
+	DECLARE_BITMAP(row_known, SCREEN_HEIGHT);
+	bool rows_stale;
+	wait_queue_head_t vsync_wait;
+	unsigned int vsync_count;
+	unsigned int fps;
+	bool adaptive;
+	/* Rate statistics, updated from SPI completion */
+	spinlock_t stats_lock;
+	ktime_t win_start;
+	unsigned int win_frames;
+	u64 win_busy_ns;
+	u64 last_busy_ns;
+	unsigned int achieved_fps; /* in 1/100 fps */
+	unsigned int bus_util; /* in 1/1000 */
+	struct st7789vfb_hist latency_hist; /* damage to flush, in us */
+	struct st7789vfb_hist spi_hist; /* bus time of a frame, in us */
+	struct st7789vfb_hist bytes_hist; /* bytes sent by a flush */
+	u64 frames_flushed;
+	u64 frames_coalesced;
+	u64 deadline_misses;
+	u64 spi_errors;
+	bool async;
+	struct fb_deferred_io defio;
+	/* Copy of st7789vfb_ops, older deferred io replaces fb_mmap in it */
+	struct fb_ops fbops;
+	/* Turn taking on the SPI controller, see struct st7789vfb_bus */
+	struct st7789vfb_bus *bus;
+	struct list_head bus_wait;
+	struct completion bus_grant;
+	u64 vtime;
+	unsigned int priority;
+	/* DRM front end, vmem is its shadow and no framebuffer is registered */
+	bool kms;
+	struct st7789vfb_drm *drm;
+	/* Wire format and FB_ROTATE_* programmed, only changed under lock */
+	bool rgb444;
+	unsigned int rotate;
+	/* Partial mode band in panel memory rows, only changed under lock */
+	bool partial;
+	unsigned int partial_start;
+	unsigned int partial_end;
 	bool bl_status;
-};
-
-enum st7789vfb_kind {
-	ST7789VFB_CMD = 0,
-	ST7789VFB_DATA = 1,
+	/* Text pool the flush renders from while the other collects damage */
+	u8 *text_spare;
+	/* Glyph cache, owned by the flush */
+	struct st7789vfb_glyphs *glyphs;
+	unsigned int glyphs_next;
+	/* No DC line: 9 bit words carry it in their top bit, see widen9() */
+	bool wire9;
+	u16 *buf9;
+	/* Controller state as last sent, to leave out commands that do nothing */
+	int dc;
+	u32 cols;
+	u32 rows;
+	u8 madctl;
+	u8 colmod;
+	/* Panel init runs after probe, nothing is sent before it is done */
+	struct work_struct init_work;
+	struct completion init_done;
+	bool ready;
+	/* Workqueue of the panel's own, NULL to flush from the shared one */
+	struct workqueue_struct *wq;
+	int flush_cpu;
+	/* Flushes of the DRM front end, which has no deferred io work */
+	struct work_struct flush_work;
+	u64 bytes_dirtied;
+	u64 bytes_flushed;
+	u64 hash_hits;
+	u64 hash_misses;
 };
 
 static ssize_t bl_status_show(struct device *dev, struct device_attribute *attr,
@@ -87,351 +380,2704 @@ static ssize_t bl_status_store(struct device *dev,
 
 static DEVICE_ATTR_RW(bl_status);
 
-static void st7789vfb_send(struct st7789vfb_par *par, enum st7789vfb_kind kind,
-			   u8 *data, size_t len)
+static ssize_t fps_show(struct device *dev, struct device_attribute *attr,
+			char *buff)
 {
-	struct spi_message msg;
-	int state;
-	int status;
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct st7789vfb_par *par = info->par;
 
-	struct spi_transfer xfer = {
-		.tx_buf = data,
-		.len = len,
-		.bits_per_word = 8,
-	};
+	return snprintf(buff, PAGE_SIZE, "%u\n", par->fps);
+}
+
+static ssize_t fps_store(struct device *dev, struct device_attribute *attr,
+			 const char *buff, size_t count)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct st7789vfb_par *par = info->par;
+	uint tmp;
+	int err;
 
-	spi_message_init(&msg);
-	spi_message_add_tail(&xfer, &msg);
+	err = kstrtouint(buff, 0, &tmp);
+	if (err)
+		return err;
 
-	state = (kind == ST7789VFB_CMD) ? 0 : 1;
+	if (tmp < ST7789VFB_FPS_MIN || tmp > ST7789VFB_FPS_MAX)
+		return -EINVAL;
+
+	par->fps = tmp;
+	info->fbdefio->delay = max(1U, HZ / par->fps);
+
+	return count;
+}
 
-	gpiod_set_value(par->pin_dc, state);
+static DEVICE_ATTR_RW(fps);
 
-	if (len > 1) {
-		dev_dbg(par->info->device,
-			"%s: sending %zu bytes (0x%02x 0x%02x 0x%02x 0x%02x)",
-			__func__, len, data[0], data[1], data[2], data[3]);
+static ssize_t adaptive_show(struct device *dev, struct device_attribute *attr,
+			     char *buff)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct st7789vfb_par *par = info->par;
+
+	return snprintf(buff, PAGE_SIZE, "%u\n", par->adaptive);
+}
+
+static ssize_t adaptive_store(struct device *dev,
+			      struct device_attribute *attr, const char *buff,
+			      size_t count)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct st7789vfb_par *par = info->par;
+	bool tmp;
+	int err;
+
+	err = kstrtobool(buff, &tmp);
+	if (err)
+		return err;
+
+	par->adaptive = tmp;
+	if (!par->adaptive)
+		info->fbdefio->delay = max(1U, HZ / par->fps);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(adaptive);
+
+/* Rates are averaged over one second, a stale window reads as idle */
+static void st7789vfb_read_rates(struct st7789vfb_par *par,
+				 unsigned int *achieved_fps,
+				 unsigned int *bus_util)
+{
+	unsigned long flags;
+	u64 elapsed;
+
+	spin_lock_irqsave(&par->stats_lock, flags);
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), par->win_start));
+	if (elapsed >= 2 * NSEC_PER_SEC) {
+		*achieved_fps = 0;
+		*bus_util = 0;
 	} else {
-		dev_dbg(par->info->device, "%s: sending 0x%02x", __func__,
-			*data);
+		*achieved_fps = par->achieved_fps;
+		*bus_util = par->bus_util;
 	}
+	spin_unlock_irqrestore(&par->stats_lock, flags);
+}
 
-	status = spi_sync(par->spi, &msg);
-	if (status < 0) {
-		dev_err(par->info->device, "SPI sync failed (%d)", status);
-	}
+static ssize_t achieved_fps_show(struct device *dev,
+				 struct device_attribute *attr, char *buff)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	unsigned int achieved_fps, bus_util;
+
+	st7789vfb_read_rates(info->par, &achieved_fps, &bus_util);
+
+	return snprintf(buff, PAGE_SIZE, "%u.%02u\n", achieved_fps / 100,
+			achieved_fps % 100);
 }
 
-static inline void st7789vfb_send_data(struct st7789vfb_par *par, u8 *data,
-				       size_t len)
+static DEVICE_ATTR_RO(achieved_fps);
+
+static ssize_t bus_util_show(struct device *dev, struct device_attribute *attr,
+			     char *buff)
 {
-	st7789vfb_send(par, ST7789VFB_DATA, data, len);
+	struct fb_info *info = dev_get_drvdata(dev);
+	unsigned int achieved_fps, bus_util;
+
+	st7789vfb_read_rates(info->par, &achieved_fps, &bus_util);
+
+	/* Percent of wall time the bus spent sending frames */
+	return snprintf(buff, PAGE_SIZE, "%u.%u\n", bus_util / 10,
+			bus_util % 10);
 }
 
-static inline void st7789vfb_send_cmd(struct st7789vfb_par *par, u8 cmd)
+static DEVICE_ATTR_RO(bus_util);
+
+static ssize_t priority_show(struct device *dev, struct device_attribute *attr,
+			     char *buff)
 {
-	st7789vfb_send(par, ST7789VFB_CMD, &cmd, 1);
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct st7789vfb_par *par = info->par;
+
+	return snprintf(buff, PAGE_SIZE, "%u\n", par->priority);
 }
 
-static void st7789vfb_set_addr_win(struct st7789vfb_par *par, int xs, int ys,
-				   int xe, int ye)
+/* Panels sharing the SPI controller get bus time in proportion to this */
+static ssize_t priority_store(struct device *dev, struct device_attribute *attr,
+			      const char *buff, size_t count)
 {
-	u8 data[4];
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct st7789vfb_par *par = info->par;
+	uint tmp;
+	int err;
+
+	err = kstrtouint(buff, 0, &tmp);
+	if (err)
+		return err;
 
-	dev_dbg(par->info->device, "%s: xs=%d, ys=%d, xe=%d, ye=%d", __func__,
-		xs, ys, xe, ye);
-	st7789vfb_send_cmd(par, MIPI_DCS_SET_COLUMN_ADDRESS);
-	data[0] = (xs >> 8) & 0xFF;
-	data[1] = xs & 0xFF;
-	data[2] = (xe >> 8) & 0xFF;
-	data[3] = xe & 0xFF;
-	st7789vfb_send_data(par, data, 4);
+	if (tmp > ST7789VFB_PRIO_MAX)
+		return -EINVAL;
 
-	st7789vfb_send_cmd(par, MIPI_DCS_SET_PAGE_ADDRESS);
-	data[0] = (ys >> 8) & 0xFF;
-	data[1] = ys & 0xFF;
-	data[2] = (ye >> 8) & 0xFF;
-	data[3] = ye & 0xFF;
-	st7789vfb_send_data(par, data, 4);
+	par->priority = tmp;
 
-	st7789vfb_send_cmd(par, MIPI_DCS_WRITE_MEMORY_START);
+	return count;
 }
 
-static int st7789vfb_write_vmem(struct st7789vfb_par *par, size_t offset,
-				size_t len)
+static DEVICE_ATTR_RW(priority);
+
+static int st7789vfb_set_partial(struct st7789vfb_par *par, bool on,
+				 unsigned int start, unsigned int end);
+
+static ssize_t partial_show(struct device *dev, struct device_attribute *attr,
+			    char *buff)
 {
-	u8 *vmem;
-	u16 *tmp;
-	size_t remain;
-	size_t max_size;
-	size_t amount;
-	int i;
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct st7789vfb_par *par = info->par;
 
-	/* Some controller can restrict the max transfer size
-	 * in that case, split message in chunk
-	 */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-	if (par->spi->master->max_transfer_size != NULL) {
-		max_size = par->spi->master->max_transfer_size(par->spi);
+	if (!par->partial)
+		return snprintf(buff, PAGE_SIZE, "off\n");
+
+	return snprintf(buff, PAGE_SIZE, "%u %u\n", par->partial_start,
+			par->partial_end);
+}
+
+/*
+ * "<first> <last>" keeps only that band of panel memory rows lit and flushed,
+ * "off" goes back to the whole screen.
+ */
+static ssize_t partial_store(struct device *dev, struct device_attribute *attr,
+			     const char *buff, size_t count)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct st7789vfb_par *par = info->par;
+	unsigned int start, end;
+	int err;
+
+	if (sysfs_streq(buff, "off")) {
+		err = st7789vfb_set_partial(par, false, 0, 0);
 	} else {
-		max_size = len;
+		if (sscanf(buff, "%u %u", &start, &end) != 2)
+			return -EINVAL;
+		if (start > end || end >= SCREEN_HEIGHT)
+			return -EINVAL;
+		err = st7789vfb_set_partial(par, true, start, end);
+	}
+
+	return err ? err : count;
+}
+
+static DEVICE_ATTR_RW(partial);
+
+static struct attribute *st7789vfb_attrs[] = {
+	&dev_attr_fps.attr,
+	&dev_attr_adaptive.attr,
+	&dev_attr_achieved_fps.attr,
+	&dev_attr_bus_util.attr,
+	&dev_attr_priority.attr,
+	&dev_attr_partial.attr,
+	NULL,
+};
+
+static const struct attribute_group st7789vfb_attr_group = {
+	.attrs = st7789vfb_attrs,
+};
+
+static void st7789vfb_wait_idle(struct st7789vfb_par *par)
+{
+	int i;
+
+	for (i = 0; i < ST7789VFB_FRAMES; i++) {
+		wait_for_completion(&par->frames[i]->done);
 	}
+}
+
+/* Commands wait for the init sequence, its reset would undo them */
+static bool st7789vfb_wait_ready(struct st7789vfb_par *par)
+{
+	wait_for_completion(&par->init_done);
+	return READ_ONCE(par->ready);
+}
+
+static inline void st7789vfb_hist_add(struct st7789vfb_hist *hist, u64 value)
+{
+	hist->count[min_t(unsigned int, fls64(value),
+			  ST7789VFB_HIST_BUCKETS - 1)]++;
+}
+
+static void st7789vfb_count_error(struct st7789vfb_par *par)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&par->stats_lock, flags);
+	par->spi_errors++;
+	spin_unlock_irqrestore(&par->stats_lock, flags);
+}
+
+/* DC is only driven when it has to change, and not at all without the line */
+static inline void st7789vfb_set_dc(struct st7789vfb_par *par, int level)
+{
+	if (!par->pin_dc || par->dc == level)
+		return;
+
+	par->dc = level;
+	if (par->async)
+		gpiod_set_value(par->pin_dc, level);
+	else
+		gpiod_set_value_cansleep(par->pin_dc, level);
+}
+
+/* Forget what the controller holds, after a reset or a failed transfer */
+static void st7789vfb_forget_state(struct st7789vfb_par *par)
+{
+	par->dc = -1;
+	par->cols = U32_MAX;
+	par->rows = U32_MAX;
+	par->madctl = ST7789VFB_REG_UNKNOWN;
+	par->colmod = ST7789VFB_REG_UNKNOWN;
+}
+
+/* Swap the bytes of every RGB565 pixel packed in a machine word */
+static inline unsigned long st7789vfb_swab16_word(unsigned long x)
+{
+#ifdef CONFIG_ARM64
+	asm("rev16 %0, %1" : "=r"(x) : "r"(x));
+	return x;
+#else
+	const unsigned long mask = (unsigned long)0x00ff00ff00ff00ffULL;
+
+	return ((x & mask) << 8) | ((x >> 8) & mask);
+#endif
+}
+
+/*
+ * Copy len bytes of RGB565 pixels from src to dst in the big endian order the
+ * controller expects. Works a machine word at a time, four words per loop.
+ */
+static void st7789vfb_swab_rgb565(u8 *dst, const u8 *src, size_t len)
+{
+#ifdef __BIG_ENDIAN
+	memcpy(dst, src, len);
 #else
-	max_size = len;
+	const size_t word = sizeof(unsigned long);
+	unsigned long a, b, c, d;
+
+	while (len >= 4 * word) {
+		a = get_unaligned((const unsigned long *)src);
+		b = get_unaligned((const unsigned long *)(src + word));
+		c = get_unaligned((const unsigned long *)(src + 2 * word));
+		d = get_unaligned((const unsigned long *)(src + 3 * word));
+		put_unaligned(st7789vfb_swab16_word(a), (unsigned long *)dst);
+		put_unaligned(st7789vfb_swab16_word(b),
+			      (unsigned long *)(dst + word));
+		put_unaligned(st7789vfb_swab16_word(c),
+			      (unsigned long *)(dst + 2 * word));
+		put_unaligned(st7789vfb_swab16_word(d),
+			      (unsigned long *)(dst + 3 * word));
+		src += 4 * word;
+		dst += 4 * word;
+		len -= 4 * word;
+	}
+
+	while (len >= 2) {
+		put_unaligned(swab16(get_unaligned((const u16 *)src)),
+			      (u16 *)dst);
+		src += 2;
+		dst += 2;
+		len -= 2;
+	}
 #endif
-	remain = len;
+}
 
-	dev_dbg(par->info->device, "%s: offset=%zu len=%zu, max_size=%zu",
-		__func__, offset, len, max_size);
-	vmem = (u8 *)(par->info->screen_base + offset);
+static inline u32 st7789vfb_rgb444(u16 pixel)
+{
+	return ((pixel >> 4) & 0xF00) | ((pixel >> 3) & 0xF0) |
+	       ((pixel >> 1) & 0xF);
+}
 
-	tmp = (u16 *)(par->info->screen_base + offset);
-	for (i = 0; i < len / 2; i++) {
-		tmp[i] = cpu_to_be16(tmp[i]);
+/*
+ * Pack len bytes of RGB565 pixels from src into the 12 bit format of the
+ * controller, two pixels in three bytes. An odd last pixel is padded out to
+ * two bytes. Returns the number of bytes written.
+ */
+static size_t st7789vfb_pack_rgb444(u8 *dst, const u8 *src, size_t len)
+{
+	const u16 *pixel = (const u16 *)src;
+	size_t n = len / 2;
+	u8 *start = dst;
+	u32 a, b;
+
+	for (; n >= 4; n -= 4, pixel += 4, dst += 6) {
+		a = st7789vfb_rgb444(pixel[0]) << 12 |
+		    st7789vfb_rgb444(pixel[1]);
+		b = st7789vfb_rgb444(pixel[2]) << 12 |
+		    st7789vfb_rgb444(pixel[3]);
+		dst[0] = a >> 16;
+		dst[1] = a >> 8;
+		dst[2] = a;
+		dst[3] = b >> 16;
+		dst[4] = b >> 8;
+		dst[5] = b;
 	}
 
-	while (remain) {
-		amount = min(max_size, remain);
-		st7789vfb_send_data(par, vmem, amount);
-		vmem += amount;
-		remain -= amount;
+	for (; n >= 2; n -= 2, pixel += 2, dst += 3) {
+		a = st7789vfb_rgb444(pixel[0]) << 12 |
+		    st7789vfb_rgb444(pixel[1]);
+		dst[0] = a >> 16;
+		dst[1] = a >> 8;
+		dst[2] = a;
 	}
 
-	return 0;
+	if (n) {
+		a = st7789vfb_rgb444(pixel[0]) << 4;
+		dst[0] = a >> 8;
+		dst[1] = a;
+		dst += 2;
+	}
+
+	return dst - start;
 }
 
-static void st7789vfb_update_display(struct st7789vfb_par *par,
-				     unsigned int start_line,
-				     unsigned int end_line)
+/* Bytes on the wire for len bytes of vmem */
+static inline size_t st7789vfb_wire_len(struct st7789vfb_par *par, size_t len)
 {
-	size_t offset, len;
-	int err;
+	return par->rgb444 ? (3 * (len / 2) + 1) / 2 : len;
+}
 
-	dev_dbg(par->info->device, "%s: start_line=%u end_line=%u", __func__,
-		start_line, end_line);
+/* Convert len bytes of vmem to the wire format at dst, returns bytes written */
+static inline size_t st7789vfb_convert(struct st7789vfb_par *par, u8 *dst,
+				       const u8 *src, size_t len)
+{
+	if (par->rgb444)
+		return st7789vfb_pack_rgb444(dst, src, len);
 
-	if (start_line > end_line) {
-		dev_warn(par->info->device,
-			 "start_line=%u is larger than end_line=%u", start_line,
-			 end_line);
-		start_line = 0;
-		end_line = par->info->var.yres - 1;
+	st7789vfb_swab_rgb565(dst, src, len);
+	return len;
+}
+
+/* Memory that len bytes on the wire take, 9 bit words are stored in a u16 */
+static inline size_t st7789vfb_mem_len(struct st7789vfb_par *par, size_t len)
+{
+	return par->wire9 ? 2 * len : len;
+}
+
+/*
+ * Turn len data bytes at buf into 9 bit words with DC set, in place: the
+ * buffer has room for twice as much. Returns the new length in bytes.
+ */
+static size_t st7789vfb_widen9(u8 *buf, size_t len)
+{
+	u16 *word = (u16 *)buf;
+	size_t i = len;
+
+	/* Back to front, a word never lands on a byte still to be read */
+	while (i--)
+		word[i] = 0x100 | buf[i];
+
+	return 2 * len;
+}
+
+static inline u8 st7789vfb_colmod(struct st7789vfb_par *par)
+{
+	return par->rgb444 ? MIPI_DCS_PIXEL_FMT_12BIT : MIPI_DCS_PIXEL_FMT_16BIT;
+}
+
+static LIST_HEAD(st7789vfb_buses);
+static DEFINE_MUTEX(st7789vfb_buses_lock);
+
+static int st7789vfb_bus_get(struct st7789vfb_par *par)
+{
+	struct spi_master *master = par->spi->master;
+	struct st7789vfb_bus *bus;
+
+	INIT_LIST_HEAD(&par->bus_wait);
+	init_completion(&par->bus_grant);
+
+	mutex_lock(&st7789vfb_buses_lock);
+	list_for_each_entry(bus, &st7789vfb_buses, node) {
+		if (bus->master == master)
+			goto found;
 	}
 
-	if (start_line > par->info->var.yres - 1 ||
-	    end_line > par->info->var.yres - 1) {
-		dev_warn(par->info->device,
-			 "start_line=%u or end_line=%u is larger than max=%d",
-			 start_line, end_line, par->info->var.yres - 1);
-		start_line = 0;
-		end_line = par->info->var.yres - 1;
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (!bus) {
+		mutex_unlock(&st7789vfb_buses_lock);
+		return -ENOMEM;
 	}
+	bus->master = master;
+	spin_lock_init(&bus->lock);
+	INIT_LIST_HEAD(&bus->waiters);
+	list_add(&bus->node, &st7789vfb_buses);
 
-	st7789vfb_set_addr_win(par, 0, start_line, par->info->var.xres - 1,
-			       end_line);
-	offset = start_line * par->info->fix.line_length;
-	len = (end_line - start_line + 1) * par->info->fix.line_length;
-	err = st7789vfb_write_vmem(par, offset, len);
-	if (err < 0) {
-		dev_err(par->info->device, "Failed to write vmem");
+found:
+	bus->refs++;
+	par->bus = bus;
+	mutex_unlock(&st7789vfb_buses_lock);
+
+	return 0;
+}
+
+static void st7789vfb_bus_put(struct st7789vfb_par *par)
+{
+	if (!par->bus)
+		return;
+
+	mutex_lock(&st7789vfb_buses_lock);
+	if (!--par->bus->refs) {
+		list_del(&par->bus->node);
+		kfree(par->bus);
 	}
+	par->bus = NULL;
+	mutex_unlock(&st7789vfb_buses_lock);
 }
 
-static char st7789vfb_pvgamctrl_data[] = {
-	0xf0, 0x0c, 0x15, 0x0d, 0x0d, 0x2a, 0x3b,
-	0x5c, 0x4b, 0x3b, 0x17, 0x15, 0x1c, 0x1f,
-};
+static void st7789vfb_bus_acquire(struct st7789vfb_par *par)
+{
+	struct st7789vfb_bus *bus = par->bus;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bus->lock, flags);
+	/* A panel back from idle doesn't get to spend the share it didn't use */
+	par->vtime = max(par->vtime, bus->vclock);
+	if (!bus->busy) {
+		bus->busy = true;
+		bus->vclock = par->vtime;
+		spin_unlock_irqrestore(&bus->lock, flags);
+		return;
+	}
 
-static char st7789vfb_nvgamctrl_data[] = {
-	0xf0, 0x0c, 0x15, 0x0d, 0x0d, 0x2a, 0x3b,
-	0x3c, 0x4b, 0x3b, 0x17, 0x15, 0x1c, 0x1f,
-};
+	reinit_completion(&par->bus_grant);
+	list_add_tail(&par->bus_wait, &bus->waiters);
+	spin_unlock_irqrestore(&bus->lock, flags);
 
-static int st7789vfb_setup_display(struct st7789vfb_par *par)
+	wait_for_completion(&par->bus_grant);
+}
+
+/* Called once a frame, or a command sent on its own, is off the bus */
+static void st7789vfb_bus_release(struct st7789vfb_par *par, u64 busy)
 {
-	u8 data[6];
+	struct st7789vfb_bus *bus = par->bus;
+	struct st7789vfb_par *next = NULL;
+	struct st7789vfb_par *waiter;
+	unsigned long flags;
 
-	if (!init) {
-		return 0;
+	spin_lock_irqsave(&bus->lock, flags);
+	par->vtime += div_u64(busy, par->priority + 1);
+
+	list_for_each_entry(waiter, &bus->waiters, bus_wait) {
+		if (!next || waiter->vtime < next->vtime)
+			next = waiter;
 	}
 
-	gpiod_set_value(par->pin_rst, 1);
-	msleep(30);
-	gpiod_set_value(par->pin_rst, 0);
-	msleep(120);
+	if (next) {
+		list_del_init(&next->bus_wait);
+		bus->vclock = next->vtime;
+		complete(&next->bus_grant);
+	} else {
+		bus->busy = false;
+	}
+	spin_unlock_irqrestore(&bus->lock, flags);
+}
 
-	st7789vfb_send_cmd(par, MIPI_DCS_EXIT_SLEEP_MODE);
-	msleep(120);
+static int st7789vfb_send(struct st7789vfb_par *par, enum st7789vfb_kind kind,
+			  u8 *data, size_t len)
+{
+	struct spi_message msg;
+	ktime_t start;
+	int state;
+	int status = 0;
+	size_t i, off, n;
 
-	st7789vfb_send_cmd(par, MIPI_DCS_SET_ADDRESS_MODE);
-	data[0] = 0;
-	st7789vfb_send_data(par, data, 1);
+	struct spi_transfer xfer = {
+		.tx_buf = data,
+		.len = len,
+		.bits_per_word = 8,
+	};
 
-	st7789vfb_send_cmd(par, MIPI_DCS_SET_PIXEL_FORMAT);
-	data[0] = MIPI_DCS_PIXEL_FMT_16BIT;
-	st7789vfb_send_data(par, data, 1);
+	state = (kind == ST7789VFB_CMD) ? 0 : 1;
 
-	st7789vfb_send_cmd(par, PORCTRL);
-	data[0] = 0x0c;
-	data[1] = 0x0c;
-	data[2] = 0x00;
-	data[3] = 0x33;
-	data[4] = 0x33;
-	st7789vfb_send_data(par, data, 5);
+	if (kind == ST7789VFB_CMD)
+		trace_st7789vfb_cmd(par->info->device, *data, 0, false);
+
+	mutex_lock(&par->lock);
+	st7789vfb_wait_idle(par);
+	/* Takes its turn on the bus like a frame, other panels may use it */
+	st7789vfb_bus_acquire(par);
+	start = ktime_get();
+	st7789vfb_set_dc(par, state);
+	if (!par->wire9) {
+		spi_message_init(&msg);
+		spi_message_add_tail(&xfer, &msg);
+		status = spi_sync(par->spi, &msg);
+	} else {
+		/* Without DC the data is widened, a buffer of it at a time */
+		for (off = 0; off < len && !status; off += n) {
+			n = min_t(size_t, len - off, ST7789VFB_BUF9_WORDS);
+			for (i = 0; i < n; i++)
+				par->buf9[i] = state << 8 | data[off + i];
+			xfer.tx_buf = par->buf9;
+			xfer.len = 2 * n;
+			xfer.bits_per_word = 9;
+			spi_message_init(&msg);
+			spi_message_add_tail(&xfer, &msg);
+			status = spi_sync(par->spi, &msg);
+		}
+	}
+	st7789vfb_bus_release(par, ktime_to_ns(ktime_sub(ktime_get(), start)));
+	/* The controller may have taken part of it, DC and window included */
+	if (status < 0)
+		st7789vfb_forget_state(par);
+	mutex_unlock(&par->lock);
+	if (status < 0) {
+		dev_err(par->info->device, "SPI sync failed (%d)", status);
+		st7789vfb_count_error(par);
+	}
+
+	return status;
+}
+
+static inline int st7789vfb_send_data(struct st7789vfb_par *par, u8 *data,
+				      size_t len)
+{
+	return st7789vfb_send(par, ST7789VFB_DATA, data, len);
+}
+
+static inline int st7789vfb_send_cmd(struct st7789vfb_par *par, u8 cmd)
+{
+	return st7789vfb_send(par, ST7789VFB_CMD, &cmd, 1);
+}
+
+/* A command followed by its len bytes of parameters */
+static int st7789vfb_send_reg(struct st7789vfb_par *par, u8 cmd, u8 *data,
+			      size_t len)
+{
+	int err;
+
+	err = st7789vfb_send_cmd(par, cmd);
+	if (err < 0 || !len)
+		return err;
+
+	return st7789vfb_send_data(par, data, len);
+}
+
+/*
+ * A frame is everything one flush puts on the bus: window commands and pixel
+ * data. DC has to flip between a command and its parameters, which cannot
+ * happen inside a single spi_message, so a frame is a chain of messages
+ * (segments) of one kind each. Each segment is submitted from the completion
+ * of the previous one, so the flush path only waits for a frame when it needs
+ * its buffers back.
+ */
+static void st7789vfb_frame_done(struct st7789vfb_frame *frame)
+{
+	struct st7789vfb_par *par = frame->par;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	u64 busy, elapsed;
+
+	busy = ktime_to_ns(ktime_sub(now, frame->start));
+
+	spin_lock_irqsave(&par->stats_lock, flags);
+	par->last_busy_ns = busy;
+	par->win_busy_ns += busy;
+	par->win_frames++;
+	st7789vfb_hist_add(&par->spi_hist, div_u64(busy, NSEC_PER_USEC));
+	if (frame->status < 0)
+		par->spi_errors++;
+
+	elapsed = ktime_to_ns(ktime_sub(now, par->win_start));
+	if (elapsed >= NSEC_PER_SEC) {
+		par->achieved_fps =
+			div64_u64((u64)par->win_frames * 100 * NSEC_PER_SEC,
+				  elapsed);
+		par->bus_util = div64_u64(par->win_busy_ns * 1000, elapsed);
+		par->win_frames = 0;
+		par->win_busy_ns = 0;
+		par->win_start = now;
+	}
+	spin_unlock_irqrestore(&par->stats_lock, flags);
+
+	/* Whatever GRAM holds now, the row hashes can't vouch for it */
+	if (frame->status < 0)
+		WRITE_ONCE(par->rows_stale, true);
+
+	trace_st7789vfb_frame_done(par->info->device, frame->status, busy);
+
+	st7789vfb_bus_release(par, busy);
+	complete_all(&frame->done);
+}
+
+static void st7789vfb_seg_complete(void *context)
+{
+	struct st7789vfb_seg *seg = context;
+	struct st7789vfb_frame *frame = seg->frame;
+	struct st7789vfb_par *par = frame->par;
+	int status;
+
+	if (seg->msg.status < 0)
+		frame->status = seg->msg.status;
+
+	if (!frame->status && ++frame->next < frame->nsegs) {
+		seg = &frame->segs[frame->next];
+		st7789vfb_set_dc(par, seg->kind);
+		status = spi_async(par->spi, &seg->msg);
+		if (!status)
+			return;
+		frame->status = status;
+	}
+
+	if (frame->status < 0) {
+		dev_err_ratelimited(par->info->device,
+				    "SPI frame failed at segment %u (%d)",
+				    frame->next, frame->status);
+	}
+	st7789vfb_frame_done(frame);
+}
+
+/* Bytes on the wire, only worked out for the tracepoint */
+static size_t st7789vfb_frame_bytes(struct st7789vfb_frame *frame)
+{
+	size_t bytes = 0;
+	unsigned int i;
+
+	for (i = 0; i < frame->nxfers; i++)
+		bytes += frame->xfers[i].len;
+
+	return bytes;
+}
+
+/* Take the next frame to fill, waiting for it to leave the bus if needed */
+static struct st7789vfb_frame *st7789vfb_frame_begin(struct st7789vfb_par *par)
+{
+	struct st7789vfb_frame *frame;
+
+	par->cur_frame = (par->cur_frame + 1) % ST7789VFB_FRAMES;
+	frame = par->frames[par->cur_frame];
+	wait_for_completion(&frame->done);
+
+	frame->nsegs = 0;
+	frame->nxfers = 0;
+	frame->txlen = 0;
+	frame->cmdlen = 0;
+	frame->nfills = 0;
+	frame->next = 0;
+	frame->status = 0;
+
+	return frame;
+}
+
+static inline bool st7789vfb_frame_room(struct st7789vfb_frame *frame,
+					unsigned int nxfers)
+{
+	return frame->nxfers + nxfers <= ST7789VFB_MAX_XFERS &&
+	       frame->nsegs + nxfers <= ST7789VFB_MAX_SEGS;
+}
+
+/* Callers check st7789vfb_frame_room() first, this cannot fail */
+static struct spi_transfer *st7789vfb_frame_xfer(struct st7789vfb_frame *frame,
+				 enum st7789vfb_kind kind, const void *buf,
+				 size_t len)
+{
+	struct st7789vfb_seg *seg = NULL;
+	struct spi_transfer *xfer;
+
+	/* Without a DC line commands and data go out in the same message */
+	if (frame->par->wire9)
+		kind = ST7789VFB_DATA;
+
+	if (frame->nsegs)
+		seg = &frame->segs[frame->nsegs - 1];
+
+	if (!seg || seg->kind != kind) {
+		seg = &frame->segs[frame->nsegs++];
+		seg->frame = frame;
+		seg->kind = kind;
+		spi_message_init(&seg->msg);
+		seg->msg.complete = st7789vfb_seg_complete;
+		seg->msg.context = seg;
+	}
+
+	xfer = &frame->xfers[frame->nxfers++];
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->tx_buf = buf;
+	xfer->len = len;
+	xfer->bits_per_word = frame->par->wire9 ? 9 : 8;
+	spi_message_add_tail(xfer, &seg->msg);
+
+	return xfer;
+}
+
+static void st7789vfb_frame_cmd(struct st7789vfb_frame *frame, u8 cmd,
+				const u8 *params, size_t len)
+{
+	u8 *buf = frame->cmdbuf + frame->cmdlen;
+	u16 *word = (u16 *)buf;
+	size_t i;
+
+	trace_st7789vfb_cmd(frame->par->info->device, cmd, len, true);
+
+	if (frame->par->wire9) {
+		word[0] = cmd;
+		for (i = 0; i < len; i++)
+			word[i + 1] = 0x100 | params[i];
+		st7789vfb_frame_xfer(frame, ST7789VFB_DATA, buf, 2 * (1 + len));
+		frame->cmdlen += 2 * (1 + len);
+		return;
+	}
+
+	buf[0] = cmd;
+	st7789vfb_frame_xfer(frame, ST7789VFB_CMD, buf, 1);
+	if (len) {
+		memcpy(buf + 1, params, len);
+		st7789vfb_frame_xfer(frame, ST7789VFB_DATA, buf + 1, len);
+	}
+	frame->cmdlen += 1 + len;
+}
+
+/*
+ * Set the window and start writing to it. RAMWR always goes out since it
+ * moves the write pointer back to the start, but CASET and RASET only when
+ * they change: repeated updates of the same area then cost a single command.
+ */
+static int st7789vfb_frame_window(struct st7789vfb_frame *frame, int xs,
+				  int ys, int xe, int ye)
+{
+	struct st7789vfb_par *par = frame->par;
+	u32 cols = (u32)xs << 16 | xe;
+	u32 rows = (u32)ys << 16 | ye;
+	u8 data[4];
+
+	if (!st7789vfb_frame_room(frame, 5) ||
+	    frame->cmdlen + st7789vfb_mem_len(par, 11) > ST7789VFB_CMDBUF_SIZE)
+		return -ENOSPC;
+
+	trace_st7789vfb_window(par->info->device, xs, ys, xe, ye);
+
+	if (cols != par->cols) {
+		data[0] = (xs >> 8) & 0xFF;
+		data[1] = xs & 0xFF;
+		data[2] = (xe >> 8) & 0xFF;
+		data[3] = xe & 0xFF;
+		st7789vfb_frame_cmd(frame, MIPI_DCS_SET_COLUMN_ADDRESS, data,
+				    4);
+		par->cols = cols;
+	}
+
+	if (rows != par->rows) {
+		data[0] = (ys >> 8) & 0xFF;
+		data[1] = ys & 0xFF;
+		data[2] = (ye >> 8) & 0xFF;
+		data[3] = ye & 0xFF;
+		st7789vfb_frame_cmd(frame, MIPI_DCS_SET_PAGE_ADDRESS, data, 4);
+		par->rows = rows;
+	}
+
+	st7789vfb_frame_cmd(frame, MIPI_DCS_WRITE_MEMORY_START, NULL, 0);
+
+	return 0;
+}
+
+/* A one byte register, left out when the controller already holds value */
+static void st7789vfb_frame_reg(struct st7789vfb_frame *frame, u8 cmd,
+				u8 *shadow, u8 value)
+{
+	if (*shadow == value)
+		return;
+
+	*shadow = value;
+	st7789vfb_frame_cmd(frame, cmd, &value, 1);
+}
+
+/* Pixel data, split in chunks the controller is able to transfer */
+static void st7789vfb_frame_pixels(struct st7789vfb_frame *frame,
+				   const u8 *buf, size_t len)
+{
+	size_t amount;
+
+	while (len) {
+		amount = min(frame->par->max_xfer, len);
+		/* Never split a 9 bit word */
+		if (frame->par->wire9)
+			amount &= ~1;
+		st7789vfb_frame_xfer(frame, ST7789VFB_DATA, buf, amount);
+
+		buf += amount;
+		len -= amount;
+	}
+}
+
+/*
+ * Queue the window and the pixels of columns [x, x + width) of lines
+ * [start_line, end_line], which the caller keeps within one pass over GRAM.
+ * Returns the number of lines queued, which is less than asked for when the
+ * frame is running out of transfers or buffer, or -ENOSPC when not even one
+ * line fits.
+ */
+static int st7789vfb_frame_lines(struct st7789vfb_par *par,
+				 struct st7789vfb_frame *frame,
+				 unsigned int start_line, unsigned int end_line,
+				 unsigned int x, unsigned int width)
+{
+	struct fb_info *info = par->info;
+	unsigned int nlines = end_line - start_line + 1;
+	unsigned int row = start_line % info->var.yres;
+	unsigned int avail, i;
+	size_t pitch, wire, len, cap;
+	const u8 *src;
+	u8 *buf;
+
+	/* RGB444 packs pixel pairs, a line of the window has to hold whole ones */
+	if (par->rgb444 && ((x | width) & 1)) {
+		width = ALIGN(width + (x & 1), 2);
+		x &= ~1;
+	}
+	pitch = width * 2;
+	wire = st7789vfb_mem_len(par, st7789vfb_wire_len(par, pitch));
+
+	if (!st7789vfb_frame_room(frame, 6))
+		return -ENOSPC;
+
+	avail = min(ST7789VFB_MAX_XFERS - frame->nxfers,
+		    ST7789VFB_MAX_SEGS - frame->nsegs) - 5;
+	cap = min_t(size_t, par->max_xfer, par->txbuf_size) * avail;
+	cap = min(cap, par->txbuf_size - frame->txlen);
+	nlines = min_t(size_t, nlines, cap / wire);
+	if (!nlines)
+		return -ENOSPC;
+
+	if (st7789vfb_frame_window(frame, x, row, x + width - 1,
+				   row + nlines - 1) < 0)
+		return -ENOSPC;
+
+	dev_dbg(info->device, "%s: x=%u width=%u line=%u nlines=%u", __func__,
+		x, width, start_line, nlines);
+
+	/* Leave the shadow framebuffer alone, transmit a converted copy */
+	buf = frame->txbuf + frame->txlen;
+	src = (u8 *)info->screen_base + start_line * info->fix.line_length +
+	      x * 2;
+	if (pitch == info->fix.line_length) {
+		len = st7789vfb_convert(par, buf, src, nlines * pitch);
+	} else {
+		/* Gather the window line by line */
+		for (i = 0, len = 0; i < nlines; i++)
+			len += st7789vfb_convert(par, buf + len,
+						 src + i * info->fix.line_length,
+						 pitch);
+	}
+	par->bytes_flushed += len;
+	if (par->wire9)
+		len = st7789vfb_widen9(buf, len);
+	st7789vfb_frame_pixels(frame, buf, len);
+	frame->txlen += len;
+
+	return nlines;
+}
+
+static irqreturn_t st7789vfb_te_irq(int irq, void *dev_id)
+{
+	struct st7789vfb_par *par = dev_id;
+
+	WRITE_ONCE(par->vsync_count, par->vsync_count + 1);
+	wake_up_all(&par->vsync_wait);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Wait for the panel to start a new refresh. Without a TE line the best sync
+ * point there is is the end of the frame currently on the bus.
+ */
+static int st7789vfb_wait_vsync(struct st7789vfb_par *par, bool interruptible)
+{
+	unsigned int count;
+	long ret;
+
+	if (!par->pin_te) {
+		st7789vfb_wait_idle(par);
+		return 0;
+	}
+
+	count = READ_ONCE(par->vsync_count);
+	if (interruptible) {
+		ret = wait_event_interruptible_timeout(
+			par->vsync_wait, READ_ONCE(par->vsync_count) != count,
+			ST7789VFB_TE_TIMEOUT);
+	} else {
+		ret = wait_event_timeout(par->vsync_wait,
+					 READ_ONCE(par->vsync_count) != count,
+					 ST7789VFB_TE_TIMEOUT);
+	}
+
+	if (ret < 0)
+		return ret;
+
+	return ret ? 0 : -ETIMEDOUT;
+}
+
+static void st7789vfb_frame_submit(struct st7789vfb_par *par,
+				   struct st7789vfb_frame *frame)
+{
+	struct st7789vfb_frame *prev;
+	struct st7789vfb_seg *seg;
+	int status;
+
+	if (!frame->nsegs)
+		return;
+
+	/* Only one chain at a time may drive DC */
+	prev = par->frames[(par->cur_frame + ST7789VFB_FRAMES - 1) %
+			   ST7789VFB_FRAMES];
+	wait_for_completion(&prev->done);
+
+	st7789vfb_bus_acquire(par);
+
+	/*
+	 * Start right behind the scan line so that the write never crosses it.
+	 * Waited for once the bus is ours, a turn of another panel in between
+	 * would use up the window.
+	 */
+	if (par->pin_te && st7789vfb_wait_vsync(par, false) < 0)
+		dev_warn_ratelimited(par->info->device, "TE pulse timed out");
+
+	reinit_completion(&frame->done);
+	frame->start = ktime_get();
+
+	if (trace_st7789vfb_frame_submit_enabled())
+		trace_st7789vfb_frame_submit(par->info->device, frame->nsegs,
+					     frame->nxfers,
+					     st7789vfb_frame_bytes(frame));
+
+	if (!par->async) {
+		/* DC sits behind a sleeping GPIO expander, go one by one */
+		for (; frame->next < frame->nsegs; frame->next++) {
+			seg = &frame->segs[frame->next];
+			st7789vfb_set_dc(par, seg->kind);
+			status = spi_sync(par->spi, &seg->msg);
+			if (status < 0) {
+				dev_err(par->info->device,
+					"SPI sync failed (%d)", status);
+				frame->status = status;
+				break;
+			}
+		}
+		st7789vfb_frame_done(frame);
+		return;
+	}
+
+	seg = &frame->segs[0];
+	st7789vfb_set_dc(par, seg->kind);
+	status = spi_async(par->spi, &seg->msg);
+	if (status < 0) {
+		dev_err(par->info->device, "SPI async failed (%d)", status);
+		frame->status = status;
+		st7789vfb_frame_done(frame);
+	}
+}
+
+/*
+ * GRAM rows [row, row + nrows) now hold something no line hash describes, or
+ * their hashes are of lines GRAM never got. The next flush sends them whatever
+ * their lines hash to.
+ */
+static inline void st7789vfb_forget_row_range(struct st7789vfb_par *par,
+					      unsigned int row,
+					      unsigned int nrows)
+{
+	bitmap_clear(par->row_known, row, nrows);
+}
+
+/* Make the next flush send every line it is asked for */
+static void st7789vfb_forget_rows(struct st7789vfb_par *par)
+{
+	WRITE_ONCE(par->rows_stale, false);
+	bitmap_zero(par->row_known, SCREEN_HEIGHT);
+}
+
+/*
+ * Queue a solid fill straight from a small colour buffer, vmem is not read
+ * back. Returns -ENOSPC when the frame has no room left for it.
+ */
+static int st7789vfb_frame_fill(struct st7789vfb_par *par,
+				struct st7789vfb_frame *frame,
+				const struct st7789vfb_fill *fill)
+{
+	size_t len = st7789vfb_wire_len(par, fill->width * fill->height * 2);
+	size_t chunk = min_t(size_t, ST7789VFB_FILL_CHUNK, par->max_xfer);
+	size_t amount;
+	unsigned int row;
+	u32 color;
+	u8 *buf;
+	int i;
+
+	/* 9 bit words take two bytes of the buffer each */
+	if (par->wire9)
+		chunk /= 2;
+	/* Chunks hold whole pixels, or whole pixel pairs for RGB444 */
+	chunk -= chunk % (par->rgb444 ? 3 : 2);
+
+	if (frame->nfills == ST7789VFB_MAX_FILLS ||
+	    !st7789vfb_frame_room(frame, 5 + DIV_ROUND_UP(len, chunk)))
+		return -ENOSPC;
+
+	row = fill->y % par->info->var.yres;
+	if (st7789vfb_frame_window(frame, fill->x, row,
+				   fill->x + fill->width - 1,
+				   row + fill->height - 1) < 0)
+		return -ENOSPC;
+
+	st7789vfb_forget_row_range(par, row, fill->height);
+
+	buf = frame->fillbuf + frame->nfills++ * ST7789VFB_FILL_CHUNK;
+	if (par->rgb444) {
+		color = st7789vfb_rgb444(fill->color);
+		for (i = 0; i < min(len, chunk); i += 3) {
+			buf[i] = color >> 4;
+			buf[i + 1] = color << 4 | color >> 8;
+			buf[i + 2] = color;
+		}
+	} else {
+		for (i = 0; i < min(len, chunk); i += 2)
+			put_unaligned_be16(fill->color, buf + i);
+	}
+	if (par->wire9)
+		st7789vfb_widen9(buf, min(len, chunk));
+
+	while (len) {
+		amount = min(chunk, len);
+		st7789vfb_frame_xfer(frame, ST7789VFB_DATA, buf,
+				     st7789vfb_mem_len(par, amount));
+		par->bytes_flushed += amount;
+		len -= amount;
+	}
+
+	return 0;
+}
+
+/* Expansion of 1 bit images for a colour pair, built on first use */
+static const struct st7789vfb_glyphs *
+st7789vfb_glyphs_get(struct st7789vfb_par *par, u16 fg, u16 bg)
+{
+	struct st7789vfb_glyphs *glyphs;
+	unsigned int i, bit;
+
+	for (i = 0; i < ST7789VFB_GLYPH_PAIRS; i++) {
+		glyphs = &par->glyphs[i];
+		if (glyphs->valid && glyphs->fg == fg && glyphs->bg == bg)
+			return glyphs;
+	}
+
+	glyphs = &par->glyphs[par->glyphs_next];
+	par->glyphs_next = (par->glyphs_next + 1) % ST7789VFB_GLYPH_PAIRS;
+
+	for (i = 0; i < 256; i++) {
+		for (bit = 0; bit < 8; bit++)
+			glyphs->pixels[i][bit] =
+				cpu_to_be16(i & (0x80 >> bit) ? fg : bg);
+	}
+	glyphs->fg = fg;
+	glyphs->bg = bg;
+	glyphs->valid = true;
+
+	return glyphs;
+}
+
+/*
+ * Queue a console text run, rendered from its 1 bit image through the glyph
+ * cache straight into the wire format. Returns -ENOSPC when the frame has no
+ * room left for it.
+ */
+static int st7789vfb_frame_text(struct st7789vfb_par *par,
+				struct st7789vfb_frame *frame,
+				const struct st7789vfb_text *text,
+				const u8 *pool)
+{
+	const struct st7789vfb_glyphs *glyphs;
+	unsigned int pitch = DIV_ROUND_UP(text->width, 8);
+	unsigned int row = text->y % par->info->var.yres;
+	size_t len = text->width * text->height * 2;
+	const u8 *bits = pool + text->offset;
+	unsigned int x, y, n;
+	__be16 *dst;
+	u8 *buf;
+
+	if (st7789vfb_mem_len(par, len) > par->txbuf_size - frame->txlen ||
+	    !st7789vfb_frame_room(frame,
+				  5 + DIV_ROUND_UP(st7789vfb_mem_len(par, len),
+						   par->max_xfer)))
+		return -ENOSPC;
+
+	if (st7789vfb_frame_window(frame, text->x, row,
+				   text->x + text->width - 1,
+				   row + text->height - 1) < 0)
+		return -ENOSPC;
+
+	glyphs = st7789vfb_glyphs_get(par, text->fg, text->bg);
+	buf = frame->txbuf + frame->txlen;
+	dst = (__be16 *)buf;
+	for (y = 0; y < text->height; y++, bits += pitch) {
+		for (x = 0; x < text->width; x += 8) {
+			n = min(8U, text->width - x);
+			memcpy(dst, glyphs->pixels[bits[x / 8]], n * 2);
+			dst += n;
+		}
+	}
+
+	st7789vfb_forget_row_range(par, row, text->height);
+
+	par->bytes_flushed += len;
+	if (par->wire9)
+		len = st7789vfb_widen9(buf, len);
+	st7789vfb_frame_pixels(frame, buf, len);
+	frame->txlen += len;
+
+	return 0;
+}
+
+/*
+ * Queue columns [x, x + width) of lines [start, end] of one GRAM pass, moving
+ * on to a new frame whenever one is full. Rows of lines it fails to queue are
+ * forgotten, so the next flush sends them whatever their hash says.
+ */
+static struct st7789vfb_frame *
+st7789vfb_queue_run(struct st7789vfb_par *par, struct st7789vfb_frame *frame,
+		    unsigned int start, unsigned int end, unsigned int x,
+		    unsigned int width)
+{
+	int ret;
+
+	while (start <= end) {
+		ret = st7789vfb_frame_lines(par, frame, start, end, x, width);
+		if (ret == -ENOSPC && frame->nsegs) {
+			st7789vfb_frame_submit(par, frame);
+			frame = st7789vfb_frame_begin(par);
+			continue;
+		}
+		if (ret < 0) {
+			dev_err(par->info->device,
+				"Failed to queue lines %u-%u (%d)", start, end,
+				ret);
+			st7789vfb_forget_row_range(par,
+						   start % par->info->var.yres,
+						   end - start + 1);
+			break;
+		}
+		start += ret;
+	}
+
+	return frame;
+}
+
+/* Whether a GRAM row lies in the partial mode band, which is in memory rows */
+static bool st7789vfb_row_partial(struct st7789vfb_par *par, unsigned int row)
+{
+	if (par->rotate == FB_ROTATE_UD)
+		row = SCREEN_HEIGHT - 1 - row;
+
+	return row >= par->partial_start && row <= par->partial_end;
+}
+
+static inline bool st7789vfb_line_visible(struct st7789vfb_par *par,
+					  unsigned int line)
+{
+	struct fb_var_screeninfo *var = &par->info->var;
+
+	if ((line + var->yres_virtual - par->yoffset) % var->yres_virtual >=
+	    var->yres)
+		return false;
+
+	/* In partial mode the rows outside the band stay dark */
+	return !par->partial || st7789vfb_row_partial(par, line % var->yres);
+}
+
+/*
+ * Compare the line with what its GRAM row was sent last time, a block of
+ * columns at a time. Apps redrawing whole frames over mmap often rewrite
+ * identical pixels, and a flipped to buffer mostly matches the one it
+ * replaces. Lines without changes are left out of the flush, of the others
+ * only columns [*x, *xend) from the first to the last changed block are sent.
+ */
+static bool st7789vfb_line_changed(struct st7789vfb_par *par,
+				   unsigned int line, unsigned int *x,
+				   unsigned int *xend)
+{
+	struct fb_info *info = par->info;
+	unsigned int row = line % info->var.yres;
+	unsigned int block = DIV_ROUND_UP(info->var.xres,
+					  ST7789VFB_HASH_BLOCKS);
+	bool known = test_bit(row, par->row_known);
+	const u8 *src = info->screen_base + line * info->fix.line_length;
+	unsigned int first = ST7789VFB_HASH_BLOCKS, last = 0;
+	unsigned int i, len;
+	u32 hash;
+
+	for (i = 0; i * block < info->var.xres; i++) {
+		len = min(block, info->var.xres - i * block);
+		hash = jhash(src + i * block * 2, len * 2, 0);
+		if (known && par->row_hash[row][i] == hash)
+			continue;
+
+		par->row_hash[row][i] = hash;
+		first = min(first, i);
+		last = i;
+	}
+	__set_bit(row, par->row_known);
+
+	if (first == ST7789VFB_HASH_BLOCKS) {
+		par->hash_hits++;
+		return false;
+	}
+	par->hash_misses++;
+
+	*x = first * block;
+	*xend = min((last + 1) * block, info->var.xres);
+
+	return true;
+}
+
+/*
+ * Only whole lines can be told apart from what GRAM holds by their hashes,
+ * which may narrow [*x, *xend) down
+ */
+static inline bool st7789vfb_line_wanted(struct st7789vfb_par *par,
+					 unsigned int line, bool whole,
+					 unsigned int *x, unsigned int *xend)
+{
+	return st7789vfb_line_visible(par, line) &&
+	       (!whole || st7789vfb_line_changed(par, line, x, xend));
+}
+
+/*
+ * vmem holds yres_virtual lines but GRAM only yres: line y lives in GRAM row
+ * y % yres and the scroll start decides which lines are on screen. Lines off
+ * screen are skipped, they are sent when scrolled into view, and so are lines
+ * GRAM already holds.
+ */
+static struct st7789vfb_frame *
+st7789vfb_queue_lines(struct st7789vfb_par *par, struct st7789vfb_frame *frame,
+		      const struct st7789vfb_rect *rect)
+{
+	unsigned int yres = par->info->var.yres;
+	bool whole = rect->width == par->info->var.xres;
+	unsigned int end = rect->y + rect->height;
+	unsigned int line, start = 0, x = 0, xend = 0;
+	unsigned int lx, lxend;
+	bool open = false, wanted;
+
+	/* Runs of wanted lines go out in the union of their columns */
+	for (line = rect->y; line <= end; line++) {
+		lx = rect->x;
+		lxend = rect->x + rect->width;
+		wanted = line < end &&
+			 st7789vfb_line_wanted(par, line, whole, &lx, &lxend);
+
+		/* A run ends at a line left out or where GRAM wraps */
+		if (open && (!wanted || !(line % yres))) {
+			frame = st7789vfb_queue_run(par, frame, start, line - 1,
+						    x, xend - x);
+			if (!whole)
+				st7789vfb_forget_row_range(par, start % yres,
+							   line - start);
+			open = false;
+		}
+		if (!wanted)
+			continue;
+
+		if (!open) {
+			start = line;
+			x = lx;
+			xend = lxend;
+			open = true;
+		} else {
+			x = min(x, lx);
+			xend = max(xend, lxend);
+		}
+	}
+
+	return frame;
+}
+
+/*
+ * Fills and text runs go out on their own only if they land in GRAM in one
+ * piece
+ */
+static bool st7789vfb_rect_visible(struct st7789vfb_par *par,
+				   const struct st7789vfb_rect *rect)
+{
+	unsigned int y;
+
+	if (rect->y % par->info->var.yres + rect->height > par->info->var.yres)
+		return false;
+
+	for (y = rect->y; y < rect->y + rect->height; y++) {
+		if (!st7789vfb_line_visible(par, y))
+			return false;
+	}
+
+	return true;
+}
+
+static struct st7789vfb_frame *
+st7789vfb_queue_scroll(struct st7789vfb_par *par,
+		       struct st7789vfb_frame *frame)
+{
+	unsigned int vsp = par->yoffset % par->info->var.yres;
+	u8 data[2];
+
+	if (!st7789vfb_frame_room(frame, 2) ||
+	    frame->cmdlen + st7789vfb_mem_len(par, 3) > ST7789VFB_CMDBUF_SIZE) {
+		st7789vfb_frame_submit(par, frame);
+		frame = st7789vfb_frame_begin(par);
+	}
+
+	data[0] = (vsp >> 8) & 0xFF;
+	data[1] = vsp & 0xFF;
+	st7789vfb_frame_cmd(frame, MIPI_DCS_SET_SCROLL_START, data, 2);
+
+	return frame;
+}
+
+static bool st7789vfb_rects_cover(const struct st7789vfb_rect *rects,
+				  unsigned int nrects,
+				  const struct st7789vfb_rect *area)
+{
+	const struct st7789vfb_rect *rect;
+	unsigned int i;
+
+	for (i = 0; i < nrects; i++) {
+		rect = &rects[i];
+		if (rect->x <= area->x && rect->y <= area->y &&
+		    rect->x + rect->width >= area->x + area->width &&
+		    rect->y + rect->height >= area->y + area->height)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Send the solid fills first, then console text and then the dirty rects:
+ * those are read from vmem, which already holds anything drawn on top of a
+ * fill or text. Text a later fill went over is turned into a rect when the
+ * fill is recorded. A new scroll start goes last, once the lines it brings
+ * into view are in GRAM.
+ */
+static void st7789vfb_account_flush(struct st7789vfb_par *par,
+				    const struct st7789vfb_damage *damage,
+				    u64 bytes)
+{
+	/*
+	 * Damage is due out after the deferred io delay, it missed its frame
+	 * when the flush comes more than a frame period after that
+	 */
+	s64 deadline = jiffies_to_usecs(par->info->fbdefio->delay) +
+		       USEC_PER_SEC / par->fps;
+	unsigned long flags;
+	s64 latency;
+
+	spin_lock_irqsave(&par->stats_lock, flags);
+	if (damage->updates) {
+		latency = ktime_us_delta(ktime_get(), damage->since);
+		st7789vfb_hist_add(&par->latency_hist, latency);
+		par->frames_coalesced += damage->updates - 1;
+		if (latency > deadline)
+			par->deadline_misses++;
+	}
+	if (bytes) {
+		st7789vfb_hist_add(&par->bytes_hist, bytes);
+		par->frames_flushed++;
+	}
+	spin_unlock_irqrestore(&par->stats_lock, flags);
+}
+
+/*
+ * Move the recorded damage to par->flushing, which the flush sends from.
+ * Called with lock held. The images stay in their text pool, new ones go to
+ * the other one.
+ */
+static void st7789vfb_take_damage(struct st7789vfb_par *par)
+{
+	struct st7789vfb_damage *damage = &par->flushing;
+	unsigned long flags;
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	*damage = par->damage;
+	par->damage.nrects = 0;
+	par->damage.nfills = 0;
+	par->damage.ntexts = 0;
+	par->damage.pool = par->text_spare;
+	par->damage.pool_len = 0;
+	par->text_spare = damage->pool;
+	par->damage.scroll = false;
+	par->damage.updates = 0;
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+}
+
+static void st7789vfb_flush(struct st7789vfb_par *par)
+{
+	const struct st7789vfb_damage *damage = &par->flushing;
+	const struct st7789vfb_fill *fill;
+	const struct st7789vfb_text *text;
+	struct st7789vfb_frame *frame;
+	struct st7789vfb_rect rect;
+	u64 flushed;
+	unsigned int i;
+	int ret;
+
+	mutex_lock(&par->lock);
+	st7789vfb_take_damage(par);
+	/* GRAM is sent whole once the panel is up, drop what came before */
+	if (!par->ready) {
+		mutex_unlock(&par->lock);
+		/* Init is done and failed, nothing will be shown any more */
+		if (completion_done(&par->init_done))
+			dev_err_ratelimited(par->info->device,
+					    "Init failed, update dropped");
+		return;
+	}
+	flushed = par->bytes_flushed;
+	trace_st7789vfb_flush_start(par->info->device, damage->nrects,
+				    damage->nfills, damage->ntexts,
+				    damage->updates, damage->scroll);
+
+	if (READ_ONCE(par->rows_stale)) {
+		st7789vfb_forget_rows(par);
+		st7789vfb_forget_state(par);
+	}
+
+	if (damage->scroll)
+		par->yoffset = damage->yoffset;
+
+	frame = st7789vfb_frame_begin(par);
+	for (i = 0; i < damage->nfills; i++) {
+		fill = &damage->fills[i];
+		rect.x = fill->x;
+		rect.y = fill->y;
+		rect.width = fill->width;
+		rect.height = fill->height;
+		if (st7789vfb_rects_cover(damage->rects, damage->nrects, &rect))
+			continue;
+
+		ret = -ENOSPC;
+		if (st7789vfb_rect_visible(par, &rect)) {
+			ret = st7789vfb_frame_fill(par, frame, fill);
+			if (ret == -ENOSPC && frame->nsegs) {
+				st7789vfb_frame_submit(par, frame);
+				frame = st7789vfb_frame_begin(par);
+				ret = st7789vfb_frame_fill(par, frame, fill);
+			}
+		}
+		if (ret < 0)
+			frame = st7789vfb_queue_lines(par, frame, &rect);
+	}
+
+	for (i = 0; i < damage->ntexts; i++) {
+		text = &damage->texts[i];
+		rect.x = text->x;
+		rect.y = text->y;
+		rect.width = text->width;
+		rect.height = text->height;
+		if (st7789vfb_rects_cover(damage->rects, damage->nrects, &rect))
+			continue;
+
+		/* The glyph cache only renders RGB565, vmem has it all too */
+		ret = -ENOSPC;
+		if (!par->rgb444 && st7789vfb_rect_visible(par, &rect)) {
+			ret = st7789vfb_frame_text(par, frame, text,
+						   damage->pool);
+			if (ret == -ENOSPC && frame->nsegs) {
+				st7789vfb_frame_submit(par, frame);
+				frame = st7789vfb_frame_begin(par);
+				ret = st7789vfb_frame_text(par, frame, text,
+							   damage->pool);
+			}
+		}
+		if (ret < 0)
+			frame = st7789vfb_queue_lines(par, frame, &rect);
+	}
+
+	for (i = 0; i < damage->nrects; i++)
+		frame = st7789vfb_queue_lines(par, frame, &damage->rects[i]);
+
+	if (damage->scroll)
+		frame = st7789vfb_queue_scroll(par, frame);
+
+	st7789vfb_frame_submit(par, frame);
+	st7789vfb_account_flush(par, damage, par->bytes_flushed - flushed);
+	trace_st7789vfb_flush_end(par->info->device,
+				  par->bytes_flushed - flushed);
+
+	mutex_unlock(&par->lock);
+}
+
+/* Bounding box of both rectangles, stored in a */
+static void st7789vfb_rect_union(struct st7789vfb_rect *a,
+				 const struct st7789vfb_rect *b)
+{
+	unsigned int x2 = max(a->x + a->width, b->x + b->width);
+	unsigned int y2 = max(a->y + a->height, b->y + b->height);
+
+	a->x = min(a->x, b->x);
+	a->y = min(a->y, b->y);
+	a->width = x2 - a->x;
+	a->height = y2 - a->y;
+}
+
+/* Pixels the bounding box of both rectangles holds that neither of them does */
+static unsigned int st7789vfb_rect_waste(const struct st7789vfb_rect *a,
+					 const struct st7789vfb_rect *b)
+{
+	struct st7789vfb_rect box = *a;
+	unsigned int x1 = max(a->x, b->x);
+	unsigned int y1 = max(a->y, b->y);
+	unsigned int x2 = min(a->x + a->width, b->x + b->width);
+	unsigned int y2 = min(a->y + a->height, b->y + b->height);
+	unsigned int both = 0;
+
+	if (x1 < x2 && y1 < y2)
+		both = (x2 - x1) * (y2 - y1);
+
+	st7789vfb_rect_union(&box, b);
+
+	return box.width * box.height - a->width * a->height -
+	       b->width * b->height + both;
+}
+
+/*
+ * Add a dirty rectangle to the list, merging it with any rectangle whose
+ * common window costs less in extra pixels than a window of its own costs in
+ * commands. Returns the new number of rectangles.
+ */
+static unsigned int st7789vfb_add_rect(struct st7789vfb_rect *rects,
+				       unsigned int nrects, unsigned int x,
+				       unsigned int y, unsigned int width,
+				       unsigned int height)
+{
+	struct st7789vfb_rect rect = {
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+	};
+	unsigned int waste, best_waste;
+	unsigned int i, best;
+
+	i = 0;
+	while (i < nrects) {
+		if (st7789vfb_rect_waste(&rect, &rects[i]) * 2 >
+		    ST7789VFB_WINDOW_COST) {
+			i++;
+			continue;
+		}
+
+		/* Absorb it, the grown rectangle may now pay off with others */
+		st7789vfb_rect_union(&rect, &rects[i]);
+		rects[i] = rects[--nrects];
+		i = 0;
+	}
+
+	if (nrects == ST7789VFB_MAX_RECTS) {
+		/* Out of slots: fold in the one that wastes the least */
+		best = 0;
+		best_waste = UINT_MAX;
+		for (i = 0; i < nrects; i++) {
+			waste = st7789vfb_rect_waste(&rect, &rects[i]);
+			if (waste < best_waste) {
+				best = i;
+				best_waste = waste;
+			}
+		}
+		st7789vfb_rect_union(&rect, &rects[best]);
+		rects[best] = rects[--nrects];
+	}
+
+	rects[nrects] = rect;
+
+	return nrects + 1;
+}
+
+static char st7789vfb_pvgamctrl_data[] = {
+	0xf0, 0x0c, 0x15, 0x0d, 0x0d, 0x2a, 0x3b,
+	0x5c, 0x4b, 0x3b, 0x17, 0x15, 0x1c, 0x1f,
+};
+
+static char st7789vfb_nvgamctrl_data[] = {
+	0xf0, 0x0c, 0x15, 0x0d, 0x0d, 0x2a, 0x3b,
+	0x3c, 0x4b, 0x3b, 0x17, 0x15, 0x1c, 0x1f,
+};
+
+static int st7789vfb_setup_display(struct st7789vfb_par *par)
+{
+	u8 data[6];
+	int err;
+
+	if (!init) {
+		return 0;
+	}
+
+	gpiod_set_value(par->pin_rst, 1);
+	msleep(30);
+	gpiod_set_value(par->pin_rst, 0);
+	msleep(120);
+	st7789vfb_forget_state(par);
+
+	err = st7789vfb_send_cmd(par, MIPI_DCS_EXIT_SLEEP_MODE);
+	if (err < 0)
+		return err;
+	msleep(120);
+
+	data[0] = st7789vfb_madctl[par->rotate];
+	err = st7789vfb_send_reg(par, MIPI_DCS_SET_ADDRESS_MODE, data, 1);
+	if (err < 0)
+		return err;
+	par->madctl = data[0];
+
+	data[0] = st7789vfb_colmod(par);
+	err = st7789vfb_send_reg(par, MIPI_DCS_SET_PIXEL_FORMAT, data, 1);
+	if (err < 0)
+		return err;
+	par->colmod = data[0];
+
+	/* The whole of GRAM scrolls, no fixed areas */
+	data[0] = 0;
+	data[1] = 0;
+	data[2] = (SCREEN_HEIGHT >> 8) & 0xFF;
+	data[3] = SCREEN_HEIGHT & 0xFF;
+	data[4] = 0;
+	data[5] = 0;
+	err = st7789vfb_send_reg(par, MIPI_DCS_SET_SCROLL_AREA, data, 6);
+	if (err < 0)
+		return err;
+
+	data[0] = 0x0c;
+	data[1] = 0x0c;
+	data[2] = 0x00;
+	data[3] = 0x33;
+	data[4] = 0x33;
+	err = st7789vfb_send_reg(par, PORCTRL, data, 5);
+	if (err < 0)
+		return err;
 
-	st7789vfb_send_cmd(par, GCTRL);
 	data[0] = 0x35;
-	st7789vfb_send_data(par, data, 1);
+	err = st7789vfb_send_reg(par, GCTRL, data, 1);
+	if (err < 0)
+		return err;
+
+	data[0] = 0x2c;
+	err = st7789vfb_send_reg(par, LCM, data, 1);
+	if (err < 0)
+		return err;
+
+	data[0] = 0x01;
+	err = st7789vfb_send_reg(par, VDVVRHEN, data, 1);
+	if (err < 0)
+		return err;
+
+	data[0] = 0x1b;
+	err = st7789vfb_send_reg(par, VRHS, data, 1);
+	if (err < 0)
+		return err;
+
+	data[0] = 0x20;
+	err = st7789vfb_send_reg(par, VDVS, data, 1);
+	if (err < 0)
+		return err;
 
-	st7789vfb_send_cmd(par, LCM);
-	data[0] = 0x2c;
-	st7789vfb_send_data(par, data, 1);
+	data[0] = 0x0f;
+	err = st7789vfb_send_reg(par, FRCTRL, data, 1);
+	if (err < 0)
+		return err;
+
+	data[0] = 0xa4;
+	data[1] = 0x71;
+	err = st7789vfb_send_reg(par, PWCTRL1, data, 2);
+	if (err < 0)
+		return err;
+
+	err = st7789vfb_send_reg(par, PVGAMCTRL, st7789vfb_pvgamctrl_data, 14);
+	if (err < 0)
+		return err;
+
+	err = st7789vfb_send_reg(par, NVGAMCTRL, st7789vfb_nvgamctrl_data, 14);
+	if (err < 0)
+		return err;
+
+	if (par->pin_te) {
+		/* TE output on vertical blanking only */
+		data[0] = 0;
+		err = st7789vfb_send_reg(par, MIPI_DCS_SET_TEAR_ON, data, 1);
+		if (err < 0)
+			return err;
+	}
+
+	err = st7789vfb_send_cmd(par, MIPI_DCS_SET_DISPLAY_ON);
+	if (err < 0)
+		return err;
+
+	if (!IS_ERR_OR_NULL(par->pin_bl)) {
+		gpiod_set_value(par->pin_bl, 1);
+	}
+
+	return 0;
+}
+
+/*
+ * The reset and init sequence sleeps for the better part of 300 ms, so it runs
+ * here instead of in probe. Damage flushed meanwhile is dropped, the whole
+ * screen goes out once the panel is up.
+ */
+static void st7789vfb_init_work(struct work_struct *work)
+{
+	struct st7789vfb_par *par =
+		container_of(work, struct st7789vfb_par, init_work);
+	int err;
+
+	err = st7789vfb_setup_display(par);
+	if (err < 0) {
+		dev_err(par->info->device, "failed to setup display (%d)", err);
+		complete_all(&par->init_done);
+		return;
+	}
+
+	mutex_lock(&par->lock);
+	par->ready = true;
+	mutex_unlock(&par->lock);
+	complete_all(&par->init_done);
+
+	st7789vfb_update_display(par, 0, par->info->var.yres_virtual - 1);
+}
+
+static void st7789vfb_teardown_display(struct st7789vfb_par *par)
+{
+	st7789vfb_send_cmd(par, MIPI_DCS_SET_DISPLAY_OFF);
+	st7789vfb_send_cmd(par, MIPI_DCS_ENTER_SLEEP_MODE);
+	if (!IS_ERR_OR_NULL(par->pin_bl)) {
+		gpiod_set_value(par->pin_bl, 0);
+	}
+	gpiod_set_value(par->pin_pwr, 0);
+}
+
+static int st7789vfb_blank(int blank, struct fb_info *info)
+{
+	struct st7789vfb_par *par = info->par;
+	bool backlighted = true;
+	u8 cmds[2][2] = {
+		{ MIPI_DCS_SET_DISPLAY_OFF, MIPI_DCS_ENTER_SLEEP_MODE },
+		{ MIPI_DCS_SET_DISPLAY_ON, MIPI_DCS_EXIT_SLEEP_MODE },
+	};
+	u8(*cmd)[2] = NULL;
+	int i;
+
+	switch (blank) {
+	case FB_BLANK_POWERDOWN:
+		backlighted = false;
+	case FB_BLANK_VSYNC_SUSPEND:
+	case FB_BLANK_HSYNC_SUSPEND:
+	case FB_BLANK_NORMAL:
+		cmd = &cmds[0];
+		break;
+	case FB_BLANK_UNBLANK:
+		cmd = &cmds[1];
+		break;
+	default:
+		return -1;
+		break;
+	}
+	if (!st7789vfb_wait_ready(par))
+		return -EIO;
+
+	if (!IS_ERR_OR_NULL(par->pin_bl)) {
+		gpiod_set_value(par->pin_bl, backlighted ? 1 : 0);
+	}
+
+	for (i = 0; i < 2; i++) {
+		st7789vfb_send_cmd(par, (*cmd)[i]);
+	}
+
+	return 0;
+}
+
+u8 *st7789vfb_vmem(struct st7789vfb_par *par, unsigned int *pitch)
+{
+	*pitch = par->info->fix.line_length;
+	return par->info->screen_base;
+}
+
+void st7789vfb_power(struct st7789vfb_par *par, bool on)
+{
+	st7789vfb_blank(on ? FB_BLANK_UNBLANK : FB_BLANK_POWERDOWN, par->info);
+}
+
+/*
+ * Small, frequent updates (cursor, touch feedback) are flushed sooner, large
+ * ones are held back while the bus is saturated so that they coalesce.
+ * Otherwise drift back to the configured rate.
+ */
+static void st7789vfb_adapt_delay(struct st7789vfb_par *par,
+				  unsigned long dirtied)
+{
+	struct fb_deferred_io *fbdefio = par->info->fbdefio;
+	unsigned long min_delay = max(1, HZ / ST7789VFB_FPS_MAX);
+	unsigned long max_delay = HZ / ST7789VFB_FPS_MIN;
+	unsigned long base = max(1U, HZ / par->fps);
+	unsigned long delay = fbdefio->delay;
+	u64 interval_ns = jiffies_to_nsecs(delay);
+	unsigned int util;
+
+	util = div64_u64(min(READ_ONCE(par->last_busy_ns), interval_ns) * 100,
+			 interval_ns);
+
+	if (dirtied <= par->txbuf_size / 16)
+		delay = max(min_delay, delay / 2);
+	else if (dirtied >= par->txbuf_size / 2 && util >= 90)
+		delay = min(max_delay, delay + delay / 2 + 1);
+	else if (delay < base)
+		delay++;
+	else if (delay > base)
+		delay--;
+
+	fbdefio->delay = delay;
+}
+
+/* Every flush runs from here, see st7789vfb_flush_wq_start() */
+static inline struct workqueue_struct *
+st7789vfb_flush_wq(struct st7789vfb_par *par)
+{
+	return par->wq ? par->wq : system_wq;
+}
+
+static void st7789vfb_schedule_flush(struct st7789vfb_par *par)
+{
+	struct fb_info *info = par->info;
+
+	queue_delayed_work_on(par->flush_cpu, st7789vfb_flush_wq(par),
+			      &info->deferred_work, info->fbdefio->delay);
+}
+
+/* Run the deferred work now, or as soon as the one in progress is done */
+static void st7789vfb_flush_now(struct st7789vfb_par *par)
+{
+	mod_delayed_work_on(par->flush_cpu, st7789vfb_flush_wq(par),
+			    &par->info->deferred_work, 0);
+}
+
+/* Count an update towards the next flush, called with damage_lock held */
+static inline void st7789vfb_damage_note(struct st7789vfb_par *par)
+{
+	if (!par->damage.updates++)
+		par->damage.since = ktime_get();
+}
+
+/*
+ * Record a rectangle the CPU drew to and schedule a flush for it. The drawing
+ * ops may be called from atomic context (fbcon), so nothing is sent from here.
+ */
+static void st7789vfb_damage_rect(struct st7789vfb_par *par, u32 x, u32 y,
+				  u32 w, u32 h, size_t dirtied)
+{
+	struct fb_var_screeninfo *var = &par->info->var;
+	unsigned long flags;
+
+	if (x >= var->xres || y >= var->yres_virtual || !w || !h)
+		return;
+	w = min(w, var->xres - x);
+	h = min(h, var->yres_virtual - y);
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	par->damage.nrects = st7789vfb_add_rect(
+		par->damage.rects, par->damage.nrects, x, y, w, h);
+	st7789vfb_damage_note(par);
+	par->bytes_dirtied += dirtied;
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	st7789vfb_schedule_flush(par);
+}
+
+void st7789vfb_update_rect(struct st7789vfb_par *par, unsigned int x,
+			   unsigned int y, unsigned int width,
+			   unsigned int height)
+{
+	struct fb_var_screeninfo *var = &par->info->var;
+	unsigned long flags;
+
+	dev_dbg(par->info->device, "%s: x=%u y=%u width=%u height=%u",
+		__func__, x, y, width, height);
+
+	if (!width || !height || x >= var->xres || y >= var->yres_virtual ||
+	    width > var->xres - x || height > var->yres_virtual - y) {
+		dev_warn(par->info->device,
+			 "%ux%u at %u,%u is outside of the %ux%u screen", width,
+			 height, x, y, var->xres, var->yres_virtual);
+		x = 0;
+		y = 0;
+		width = var->xres;
+		height = var->yres_virtual;
+	}
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	par->damage.nrects = st7789vfb_add_rect(par->damage.rects,
+						par->damage.nrects, x, y,
+						width, height);
+	st7789vfb_damage_note(par);
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	/* From the workqueue the deferred io work runs on, and waited for */
+	queue_work_on(par->flush_cpu, st7789vfb_flush_wq(par),
+		      &par->flush_work);
+	flush_work(&par->flush_work);
+}
+
+void st7789vfb_update_display(struct st7789vfb_par *par,
+			      unsigned int start_line, unsigned int end_line)
+{
+	unsigned int max_line = par->info->var.yres_virtual - 1;
+
+	if (start_line > end_line) {
+		dev_warn(par->info->device,
+			 "start_line=%u is larger than end_line=%u", start_line,
+			 end_line);
+		start_line = 0;
+		end_line = max_line;
+	}
+
+	if (start_line > max_line || end_line > max_line) {
+		dev_warn(par->info->device,
+			 "start_line=%u or end_line=%u is larger than max=%d",
+			 start_line, end_line, max_line);
+		start_line = 0;
+		end_line = max_line;
+	}
+
+	st7789vfb_update_rect(par, 0, start_line, par->info->var.xres,
+			      end_line - start_line + 1);
+}
+
+/*
+ * Text under a new fill would be rendered after it, so it goes out from vmem
+ * as a rect instead. Called with damage_lock held.
+ */
+static void st7789vfb_drop_texts(struct st7789vfb_par *par, u32 x, u32 y,
+				 u32 w, u32 h)
+{
+	struct st7789vfb_text *text;
+	unsigned int i = 0;
+
+	while (i < par->damage.ntexts) {
+		text = &par->damage.texts[i];
+		if (text->x >= x + w || x >= text->x + text->width ||
+		    text->y >= y + h || y >= text->y + text->height) {
+			i++;
+			continue;
+		}
+
+		par->damage.nrects = st7789vfb_add_rect(
+			par->damage.rects, par->damage.nrects, text->x, text->y,
+			text->width, text->height);
+		/* Keep the order, later text may be drawn over earlier */
+		memmove(text, text + 1,
+			(--par->damage.ntexts - i) * sizeof(*text));
+	}
+}
+
+static void st7789vfb_fillrect(struct fb_info *info,
+			       const struct fb_fillrect *rect)
+{
+	struct st7789vfb_par *par = info->par;
+	struct st7789vfb_fill *fill;
+	unsigned long flags;
+	u32 width, height;
+
+	sys_fillrect(info, rect);
+
+	if (rect->dx >= info->var.xres || rect->dy >= info->var.yres_virtual)
+		return;
+	width = min(rect->width, info->var.xres - rect->dx);
+	height = min(rect->height, info->var.yres_virtual - rect->dy);
+	if (!width || !height)
+		return;
+
+	if (rect->rop != ROP_COPY) {
+		st7789vfb_damage_rect(par, rect->dx, rect->dy, width, height,
+				      width * height * 2);
+		return;
+	}
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	if (par->damage.nfills == ST7789VFB_MAX_FILLS) {
+		spin_unlock_irqrestore(&par->damage_lock, flags);
+		st7789vfb_damage_rect(par, rect->dx, rect->dy, width, height,
+				      width * height * 2);
+		return;
+	}
+
+	st7789vfb_drop_texts(par, rect->dx, rect->dy, width, height);
+
+	/* Pseudocolor visual: the colour is the RGB565 value itself */
+	fill = &par->damage.fills[par->damage.nfills++];
+	fill->x = rect->dx;
+	fill->y = rect->dy;
+	fill->width = width;
+	fill->height = height;
+	fill->color = rect->color;
+	par->bytes_dirtied += width * height * 2;
+	st7789vfb_damage_note(par);
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	st7789vfb_schedule_flush(par);
+}
+
+static void st7789vfb_copyarea(struct fb_info *info,
+			       const struct fb_copyarea *area)
+{
+	sys_copyarea(info, area);
+	st7789vfb_damage_rect(info->par, area->dx, area->dy, area->width,
+			      area->height, area->width * area->height * 2);
+}
+
+/*
+ * Keep a 1 bit image (console text) to be rendered through the glyph cache and
+ * have it flushed right away, so that console output is not held back by the
+ * deferred io delay. Returns false when there is no room left for it.
+ */
+static bool st7789vfb_damage_text(struct st7789vfb_par *par,
+				  const struct fb_image *image)
+{
+	struct fb_var_screeninfo *var = &par->info->var;
+	unsigned int size = DIV_ROUND_UP(image->width, 8) * image->height;
+	struct st7789vfb_text *text;
+	unsigned long flags;
+
+	if (image->depth != 1 || !image->width || !image->height ||
+	    image->dx >= var->xres || image->width > var->xres - image->dx ||
+	    image->dy >= var->yres_virtual ||
+	    image->height > var->yres_virtual - image->dy)
+		return false;
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	if (par->damage.ntexts == ST7789VFB_MAX_TEXTS ||
+	    size > ST7789VFB_TEXT_POOL - par->damage.pool_len) {
+		spin_unlock_irqrestore(&par->damage_lock, flags);
+		return false;
+	}
+
+	text = &par->damage.texts[par->damage.ntexts++];
+	text->x = image->dx;
+	text->y = image->dy;
+	text->width = image->width;
+	text->height = image->height;
+	text->fg = image->fg_color;
+	text->bg = image->bg_color;
+	text->offset = par->damage.pool_len;
+	memcpy(par->damage.pool + text->offset, image->data, size);
+	par->damage.pool_len += size;
+	par->bytes_dirtied += image->width * image->height * 2;
+	st7789vfb_damage_note(par);
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	st7789vfb_flush_now(par);
+
+	return true;
+}
+
+static void st7789vfb_imageblit(struct fb_info *info,
+				const struct fb_image *image)
+{
+	sys_imageblit(info, image);
+	if (st7789vfb_damage_text(info->par, image))
+		return;
+
+	st7789vfb_damage_rect(info->par, image->dx, image->dy, image->width,
+			      image->height, image->width * image->height * 2);
+}
+
+/*
+ * Writes only land in vmem and mark damage, the transfer joins the deferred
+ * flush together with mmap and console damage. Writers never wait for the
+ * bus. There is no blocking variant to pick with O_NONBLOCK, fb_write() gets
+ * no file to read the flag from. fsync() runs the deferred work, which
+ * returns once its frames are off the bus.
+ */
+static ssize_t st7789vfb_write(struct fb_info *info, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct st7789vfb_par *par = info->par;
+	unsigned long total_size;
+	unsigned long p = *ppos;
+	unsigned int start_line;
+	unsigned int end_line;
+	unsigned int x, width;
+	u8 __iomem *dst;
+
+	total_size = info->fix.line_length * info->var.yres_virtual;
+
+	if (p > total_size)
+		return -EINVAL;
+
+	if (count + p > total_size)
+		count = total_size - p;
+
+	if (!count)
+		return -EINVAL;
+
+	dst = (void __force *)(info->screen_base + p);
+
+	if (copy_from_user(dst, buf, count))
+		return -EFAULT;
+
+	dev_dbg(info->device, "%s: writing %zu bytes at %lld", __func__, count,
+		*ppos);
+
+	start_line = p / info->fix.line_length;
+	end_line = (p + count - 1) / info->fix.line_length;
+
+	/* A write within one line only touches a few of its pixels */
+	x = 0;
+	width = info->var.xres;
+	if (start_line == end_line) {
+		x = (p % info->fix.line_length) / 2;
+		width = ((p + count - 1) % info->fix.line_length) / 2 - x + 1;
+	}
+
+	st7789vfb_damage_rect(par, x, start_line, width,
+			      end_line - start_line + 1, count);
+
+	*ppos += count;
+
+	return count;
+}
+
+/*
+ * Rectangles a client reports drawing to join the pending damage, and the
+ * deferred work runs right away instead of after its delay.
+ */
+static int st7789vfb_dirty(struct st7789vfb_par *par, void __user *argp)
+{
+	struct fb_var_screeninfo *var = &par->info->var;
+	struct st7789vfb_dirty_rect *rects, *rect;
+	struct st7789vfb_dirty dirty;
+	unsigned long flags;
+	bool added = false;
+	unsigned int i;
+	u32 w, h;
+
+	if (copy_from_user(&dirty, argp, sizeof(dirty)))
+		return -EFAULT;
+	if (dirty.flags & ~ST7789VFB_DIRTY_WAIT)
+		return -EINVAL;
+	if (!dirty.nrects || dirty.nrects > ST7789VFB_DIRTY_MAX)
+		return -EINVAL;
+
+	rects = memdup_user(u64_to_user_ptr(dirty.rects),
+			    dirty.nrects * sizeof(*rects));
+	if (IS_ERR(rects))
+		return PTR_ERR(rects);
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	for (i = 0; i < dirty.nrects; i++) {
+		rect = &rects[i];
+		if (rect->x >= var->xres || rect->y >= var->yres_virtual)
+			continue;
+		w = min(rect->width, var->xres - rect->x);
+		h = min(rect->height, var->yres_virtual - rect->y);
+		if (!w || !h)
+			continue;
+
+		par->damage.nrects = st7789vfb_add_rect(
+			par->damage.rects, par->damage.nrects, rect->x, rect->y,
+			w, h);
+		par->bytes_dirtied += w * h * 2;
+		added = true;
+	}
+	if (added)
+		st7789vfb_damage_note(par);
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	kfree(rects);
+
+	st7789vfb_flush_now(par);
+	if (dirty.flags & ST7789VFB_DIRTY_WAIT) {
+		/* The flush is done once its frames are off the bus */
+		flush_delayed_work(&par->info->deferred_work);
+		st7789vfb_wait_idle(par);
+	}
+
+	return 0;
+}
+
+static int st7789vfb_ioctl(struct fb_info *info, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct st7789vfb_par *par = info->par;
+	u32 crtc;
+
+	switch (cmd) {
+	case FBIO_WAITFORVSYNC:
+		if (get_user(crtc, (u32 __user *)arg))
+			return -EFAULT;
+		if (crtc != 0)
+			return -ENODEV;
+		/* Pan then wait: the flip has to be on the panel first */
+		flush_delayed_work(&info->deferred_work);
+		st7789vfb_wait_idle(par);
+		return st7789vfb_wait_vsync(par, true);
+	case ST7789VFB_IOCTL_DIRTY:
+		return st7789vfb_dirty(par, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+static int st7789vfb_compat_ioctl(struct fb_info *info, unsigned int cmd,
+				  unsigned long arg)
+{
+	return st7789vfb_ioctl(info, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+/*
+ * Mappings at ST7789VFB_MMAP_UNTRACKED skip the write protection deferred io
+ * relies on, their clients report damage with ST7789VFB_IOCTL_DIRTY.
+ */
+static int st7789vfb_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	unsigned long untracked = ST7789VFB_MMAP_UNTRACKED >> PAGE_SHIFT;
+
+	if (vma->vm_pgoff < untracked)
+		return fb_deferred_io_mmap(info, vma);
+
+	return remap_vmalloc_range(vma, info->screen_base,
+				   vma->vm_pgoff - untracked);
+}
+
+/*
+ * Geometry of a rotation, 90 and 270 degrees swap the axes. Hardware scrolling
+ * moves GRAM rows, which only line up with vmem lines unrotated, so rotated
+ * the only pans are flips between the two halves of vmem.
+ */
+static void st7789vfb_rotate_var(struct fb_var_screeninfo *var)
+{
+	bool swap = var->rotate == FB_ROTATE_CW || var->rotate == FB_ROTATE_CCW;
+
+	var->xres = swap ? SCREEN_HEIGHT : SCREEN_WIDTH;
+	var->yres = swap ? SCREEN_WIDTH : SCREEN_HEIGHT;
+	var->xres_virtual = var->xres;
+	var->yres_virtual = var->yres * 2;
+	if (var->yoffset >= var->yres_virtual ||
+	    (var->rotate != FB_ROTATE_UR && var->yoffset % var->yres))
+		var->yoffset = 0;
+}
+
+static void st7789vfb_rotate_fix(struct fb_info *info)
+{
+	bool scroll = info->var.rotate == FB_ROTATE_UR;
+
+	info->fix.line_length = info->var.xres * info->var.bits_per_pixel / 8;
+	info->fix.ypanstep = scroll ? 1 : info->var.yres;
+	info->fix.ywrapstep = scroll;
+	if (scroll)
+		info->flags |= FBINFO_HWACCEL_YPAN | FBINFO_HWACCEL_YWRAP;
+	else
+		info->flags &= ~(FBINFO_HWACCEL_YPAN | FBINFO_HWACCEL_YWRAP);
+}
+
+/* Pixel format and resolution are fixed, the wire format and rotation not */
+static int st7789vfb_check_var(struct fb_var_screeninfo *var,
+			       struct fb_info *info)
+{
+	struct st7789vfb_par *par = info->par;
+
+	switch (var->nonstd) {
+	case 0:
+		var->nonstd = ST7789VFB_NONSTD_RGB565;
+		break;
+	case ST7789VFB_NONSTD_RGB565:
+	case ST7789VFB_NONSTD_RGB444:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (var->rotate > FB_ROTATE_CCW)
+		return -EINVAL;
+	/* Memory rows run across the screen then, the band would make no sense */
+	if ((var->rotate == FB_ROTATE_CW || var->rotate == FB_ROTATE_CCW) &&
+	    par->partial)
+		return -EBUSY;
+	if (var->rotate != info->var.rotate)
+		var->yoffset = 0;
+
+	st7789vfb_rotate_var(var);
+	var->xoffset = 0;
+	var->bits_per_pixel = info->var.bits_per_pixel;
+	var->grayscale = 0;
+	var->red = info->var.red;
+	var->green = info->var.green;
+	var->blue = info->var.blue;
+	var->transp = info->var.transp;
+
+	return 0;
+}
+
+/*
+ * GRAM holds 18 bit pixels whatever the interface format, so switching it only
+ * needs COLMOD reprogrammed before the next pixels go out. A rotation changes
+ * the address mode and the vmem layout, so the screen is sent again.
+ */
+static int st7789vfb_set_par(struct fb_info *info)
+{
+	struct st7789vfb_par *par = info->par;
+	bool rgb444 = info->var.nonstd == ST7789VFB_NONSTD_RGB444;
+	bool rotated = info->var.rotate != par->rotate;
+	struct st7789vfb_frame *frame;
+	unsigned long flags;
+	bool ready;
+	u8 data[2];
+
+	if (rgb444 == par->rgb444 && !rotated)
+		return 0;
+
+	ready = st7789vfb_wait_ready(par);
+
+	/* The flush reads vmem by line_length, it must not see it change */
+	mutex_lock(&par->lock);
+	st7789vfb_wait_idle(par);
+	if (rotated) {
+		st7789vfb_rotate_fix(info);
+
+		/* Pending damage was recorded in the old layout */
+		spin_lock_irqsave(&par->damage_lock, flags);
+		par->damage.nrects = 0;
+		par->damage.nfills = 0;
+		par->damage.ntexts = 0;
+		par->damage.pool_len = 0;
+		par->damage.yoffset = 0;
+		par->damage.scroll = false;
+		spin_unlock_irqrestore(&par->damage_lock, flags);
+	}
 
-	st7789vfb_send_cmd(par, VDVVRHEN);
-	data[0] = 0x01;
-	st7789vfb_send_data(par, data, 1);
+	if (!ready) {
+		mutex_unlock(&par->lock);
+		return -EIO;
+	}
 
-	st7789vfb_send_cmd(par, VRHS);
-	data[0] = 0x1b;
-	st7789vfb_send_data(par, data, 1);
+	frame = st7789vfb_frame_begin(par);
+	/*
+	 * Rows sent in RGB444 lost precision and rotated rows land elsewhere,
+	 * either way they have to be sent again
+	 */
+	st7789vfb_forget_rows(par);
+	par->rgb444 = rgb444;
+	st7789vfb_frame_reg(frame, MIPI_DCS_SET_PIXEL_FORMAT, &par->colmod,
+			    st7789vfb_colmod(par));
+	if (rotated) {
+		par->rotate = info->var.rotate;
+		par->yoffset = 0;
+		st7789vfb_frame_reg(frame, MIPI_DCS_SET_ADDRESS_MODE,
+				    &par->madctl,
+				    st7789vfb_madctl[par->rotate]);
+		data[0] = 0;
+		data[1] = 0;
+		st7789vfb_frame_cmd(frame, MIPI_DCS_SET_SCROLL_START, data, 2);
+	}
+	st7789vfb_frame_submit(par, frame);
+	mutex_unlock(&par->lock);
 
-	st7789vfb_send_cmd(par, VDVS);
-	data[0] = 0x20;
-	st7789vfb_send_data(par, data, 1);
+	dev_dbg(info->device, "%s: wire format %s, rotation %u", __func__,
+		rgb444 ? "RGB444" : "RGB565", par->rotate * 90);
 
-	st7789vfb_send_cmd(par, FRCTRL);
-	data[0] = 0x0f;
-	st7789vfb_send_data(par, data, 1);
+	if (rotated)
+		st7789vfb_update_display(par, 0, info->var.yres_virtual - 1);
 
-	st7789vfb_send_cmd(par, PWCTRL1);
-	data[0] = 0xa4;
-	data[1] = 0x71;
-	st7789vfb_send_data(par, data, 2);
+	return 0;
+}
 
-	st7789vfb_send_cmd(par, PVGAMCTRL);
-	st7789vfb_send_data(par, st7789vfb_pvgamctrl_data, 14);
+/*
+ * Partial mode keeps the controller refreshing only a band of rows, the rest
+ * of the panel is dark. Only lines in the band are flushed meanwhile, so on
+ * the way out the screen is sent again; row hashes keep that to what changed.
+ */
+static int st7789vfb_set_partial(struct st7789vfb_par *par, bool on,
+				 unsigned int start, unsigned int end)
+{
+	struct st7789vfb_frame *frame;
+	u8 data[4];
 
-	st7789vfb_send_cmd(par, NVGAMCTRL);
-	st7789vfb_send_data(par, st7789vfb_nvgamctrl_data, 14);
+	if (!st7789vfb_wait_ready(par))
+		return -EIO;
 
-	st7789vfb_send_cmd(par, MIPI_DCS_SET_DISPLAY_ON);
+	mutex_lock(&par->lock);
+	if (on && (par->rotate == FB_ROTATE_CW ||
+		   par->rotate == FB_ROTATE_CCW)) {
+		mutex_unlock(&par->lock);
+		return -EBUSY;
+	}
 
-	if (!IS_ERR_OR_NULL(par->pin_bl)) {
-		gpiod_set_value(par->pin_bl, 1);
+	frame = st7789vfb_frame_begin(par);
+	if (on) {
+		data[0] = (start >> 8) & 0xFF;
+		data[1] = start & 0xFF;
+		data[2] = (end >> 8) & 0xFF;
+		data[3] = end & 0xFF;
+		st7789vfb_frame_cmd(frame, MIPI_DCS_SET_PARTIAL_ROWS, data, 4);
+		st7789vfb_frame_cmd(frame, MIPI_DCS_ENTER_PARTIAL_MODE, NULL,
+				    0);
+	} else {
+		st7789vfb_frame_cmd(frame, MIPI_DCS_ENTER_NORMAL_MODE, NULL, 0);
 	}
+	par->partial = on;
+	par->partial_start = start;
+	par->partial_end = end;
+	st7789vfb_frame_submit(par, frame);
+	mutex_unlock(&par->lock);
+
+	dev_dbg(par->info->device, "%s: partial mode %s (%u-%u)", __func__,
+		on ? "on" : "off", start, end);
+
+	if (!on)
+		st7789vfb_update_display(par, 0,
+					 par->info->var.yres_virtual - 1);
 
 	return 0;
 }
 
-static void st7789vfb_teardown_display(struct st7789vfb_par *par)
+/*
+ * Panning only moves the scroll start of the controller, GRAM keeps the lines
+ * that stay on screen. Like the drawing ops this may run in atomic context, so
+ * the new offset and the lines it brings into view are left to the flush.
+ *
+ * Panning by a whole screen is a page flip: the app draws into the hidden
+ * half of vmem while the flush reads only the shown one, so no frame goes out
+ * half drawn. The flip is flushed right away and the row hashes keep it down
+ * to what differs from the buffer shown before.
+ */
+static int st7789vfb_pan_display(struct fb_var_screeninfo *var,
+				 struct fb_info *info)
 {
-	st7789vfb_send_cmd(par, MIPI_DCS_SET_DISPLAY_OFF);
-	st7789vfb_send_cmd(par, MIPI_DCS_ENTER_SLEEP_MODE);
-	if (!IS_ERR_OR_NULL(par->pin_bl)) {
-		gpiod_set_value(par->pin_bl, 0);
-	}
-	gpiod_set_value(par->pin_pwr, 0);
-}
+	struct st7789vfb_par *par = info->par;
+	unsigned int yres = info->var.yres;
+	unsigned int yvirt = info->var.yres_virtual;
+	unsigned int delta, first, count;
+	unsigned long flags;
 
-static ssize_t st7789vfb_write(struct fb_info *info, const char __user *buf,
-			       size_t count, loff_t *ppos)
-{
-	unsigned long total_size;
-	unsigned long p = *ppos;
-	unsigned int start_line;
-	unsigned int end_line;
-	u8 __iomem *dst;
+	if (var->xoffset)
+		return -EINVAL;
+	if (info->var.rotate != FB_ROTATE_UR &&
+	    ((var->vmode & FB_VMODE_YWRAP) || var->yoffset % yres))
+		return -EINVAL;
+	if (var->vmode & FB_VMODE_YWRAP) {
+		if (var->yoffset >= yvirt)
+			return -EINVAL;
+	} else if (var->yoffset + yres > yvirt) {
+		return -EINVAL;
+	}
 
-	total_size = info->fix.smem_len;
+	spin_lock_irqsave(&par->damage_lock, flags);
+	delta = (var->yoffset + yvirt - par->damage.yoffset) % yvirt;
+	if (!delta) {
+		spin_unlock_irqrestore(&par->damage_lock, flags);
+		return 0;
+	}
 
-	if (p > total_size)
-		return -EINVAL;
+	if (delta <= yres) {
+		/* Forward, the new lines come in at the bottom */
+		first = (par->damage.yoffset + yres) % yvirt;
+		count = delta;
+	} else {
+		/* Backward, the new lines come in at the top */
+		first = var->yoffset;
+		count = yvirt - delta;
+	}
 
-	if (count + p > total_size)
-		count = total_size - p;
+	par->damage.nrects = st7789vfb_add_rect(
+		par->damage.rects, par->damage.nrects, 0, first, info->var.xres,
+		min(first + count, yvirt) - first);
+	if (first + count > yvirt) {
+		par->damage.nrects = st7789vfb_add_rect(
+			par->damage.rects, par->damage.nrects, 0, 0,
+			info->var.xres, first + count - yvirt);
+	}
+	par->damage.yoffset = var->yoffset;
+	par->damage.scroll = true;
+	st7789vfb_damage_note(par);
+	spin_unlock_irqrestore(&par->damage_lock, flags);
 
-	if (!count)
-		return -EINVAL;
+	if (count == yres)
+		st7789vfb_flush_now(par);
+	else
+		st7789vfb_schedule_flush(par);
 
-	dst = (void __force *)(info->screen_base + p);
+	return 0;
+}
 
-	if (copy_from_user(dst, buf, count))
-		return -EFAULT;
+/* First write through mmap since the last flush */
+static void st7789vfb_first_io(struct fb_info *info)
+{
+	struct st7789vfb_par *par = info->par;
+	unsigned long flags;
 
-	dev_dbg(info->device, "%s: writing %zu bytes at %lld", __func__, count,
-		*ppos);
+	spin_lock_irqsave(&par->damage_lock, flags);
+	st7789vfb_damage_note(par);
+	spin_unlock_irqrestore(&par->damage_lock, flags);
 
-	start_line = p / info->fix.line_length;
-	end_line = (p + count) / info->fix.line_length - 1;
+	trace_st7789vfb_first_io(info->device, info->fbdefio->delay);
 
-	st7789vfb_update_display(info->par, start_line, end_line);
+	/*
+	 * Deferred io schedules its work on the shared workqueue right after
+	 * this, queued here first it stays on the one we picked
+	 */
+	st7789vfb_schedule_flush(par);
+}
 
-	*ppos += count;
+static void st7789vfb_flush_work(struct work_struct *work)
+{
+	struct st7789vfb_par *par =
+		container_of(work, struct st7789vfb_par, flush_work);
 
-	return count;
+	st7789vfb_flush(par);
 }
 
-static int st7789vfb_blank(int blank, struct fb_info *info)
+static void st7789vfb_deferred_io(struct fb_info *info,
+				  struct list_head *pagelist)
 {
 	struct st7789vfb_par *par = info->par;
-	bool backlighted = true;
-	u8 cmds[2][2] = {
-		{ MIPI_DCS_SET_DISPLAY_OFF, MIPI_DCS_ENTER_SLEEP_MODE },
-		{ MIPI_DCS_SET_DISPLAY_ON, MIPI_DCS_EXIT_SLEEP_MODE },
-	};
-	u8(*cmd)[2] = NULL;
-	int i;
+	struct st7789vfb_damage *damage = &par->damage;
+	unsigned long dirtied = 0;
+	unsigned long flags;
+	const struct st7789vfb_rect *rect;
+	unsigned int first, last;
+	unsigned int npages = 0;
+	unsigned int updates;
+	ktime_t since;
+	unsigned int i;
+	unsigned long offset;
+	unsigned long len;
+	unsigned long total_size =
+		info->fix.line_length * info->var.yres_virtual;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+	struct fb_deferred_io_pageref *pageref;
+#else
+	struct page *page;
+#endif
 
-	switch (blank) {
-	case FB_BLANK_POWERDOWN:
-		backlighted = false;
-	case FB_BLANK_VSYNC_SUSPEND:
-	case FB_BLANK_HSYNC_SUSPEND:
-	case FB_BLANK_NORMAL:
-		cmd = &cmds[0];
-		break;
-	case FB_BLANK_UNBLANK:
-		cmd = &cmds[1];
-		break;
-	default:
-		return -1;
-		break;
+	spin_lock_irqsave(&par->damage_lock, flags);
+	/* The drawing ops have accounted for their own damage already */
+	for (i = 0; i < damage->nrects; i++) {
+		rect = &damage->rects[i];
+		dirtied += rect->width * rect->height * 2;
 	}
-	if (!IS_ERR_OR_NULL(par->pin_bl)) {
-		gpiod_set_value(par->pin_bl, backlighted ? 1 : 0);
+	for (i = 0; i < damage->nfills; i++)
+		dirtied += damage->fills[i].width * damage->fills[i].height * 2;
+	for (i = 0; i < damage->ntexts; i++)
+		dirtied += damage->texts[i].width * damage->texts[i].height * 2;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+	list_for_each_entry(pageref, pagelist, list) {
+		offset = pageref->offset;
+#else
+	list_for_each_entry(page, pagelist, lru) {
+		offset = page->index << PAGE_SHIFT;
+#endif
+		/* Rotated, the end of vmem is not part of any line */
+		if (offset >= total_size)
+			continue;
+
+		len = min_t(unsigned long, PAGE_SIZE, total_size - offset);
+		par->bytes_dirtied += len;
+		dirtied += len;
+		npages++;
+		/* Pages are not aligned to lines, they dirty whole ones */
+		first = offset / info->fix.line_length;
+		last = (offset + len - 1) / info->fix.line_length;
+		damage->nrects = st7789vfb_add_rect(damage->rects,
+						    damage->nrects, 0, first,
+						    info->var.xres,
+						    last - first + 1);
 	}
+	updates = damage->updates;
+	since = damage->since;
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	trace_st7789vfb_deferred_io(info->device, npages, updates, since);
+
+	/* The flush takes the damage, recorded pages and drawing ops alike */
+	st7789vfb_flush(par);
+	/*
+	 * fsync() returns when this work does, so the work waits for the bus.
+	 * The next run is a deferred io delay away, there is little overlap
+	 * to lose.
+	 */
+	st7789vfb_wait_idle(par);
 
-	for (i = 0; i < 2; i++) {
-		st7789vfb_send_cmd(par, (*cmd)[i]);
+	if (par->adaptive)
+		st7789vfb_adapt_delay(par, dirtied);
+}
+
+/*
+ * Flushes run from the deferred io work on the shared workqueue, where under
+ * load they wait behind unrelated work. A panel can have a high priority
+ * workqueue of its own instead, bound to flush_cpu or unbound. Unbound, its
+ * cpumask and nice level are in /sys/devices/virtual/workqueue.
+ */
+static int st7789vfb_flush_wq_start(struct st7789vfb_par *par,
+				    struct device *dev)
+{
+	unsigned int flags = WQ_HIGHPRI;
+
+	par->flush_cpu = WORK_CPU_UNBOUND;
+	if (!flush_wq)
+		return 0;
+
+	if (flush_cpu >= 0) {
+		if (flush_cpu >= nr_cpu_ids || !cpu_online(flush_cpu)) {
+			dev_err(dev, "flush_cpu %d is not online", flush_cpu);
+			return -EINVAL;
+		}
+		par->flush_cpu = flush_cpu;
+	} else {
+		flags |= WQ_UNBOUND | WQ_SYSFS;
 	}
 
+	par->wq = alloc_workqueue(DRV_NAME "-%s", flags, 1, dev_name(dev));
+	if (!par->wq) {
+		dev_err(dev, "Fail to allocate the flush workqueue");
+		return -ENOMEM;
+	}
+
+	dev_dbg(dev, "%s: flush workqueue on cpu %d", __func__, flush_cpu);
+
 	return 0;
 }
 
-static void st7789vfb_deferred_io(struct fb_info *info,
-				  struct list_head *pagelist)
+/* Nothing may queue flushes any more, what is queued still runs */
+static void st7789vfb_flush_wq_stop(struct st7789vfb_par *par)
 {
-	st7789vfb_update_display(info->par, 0, SCREEN_HEIGHT - 1);
+	cancel_work_sync(&par->flush_work);
+	if (par->wq)
+		destroy_workqueue(par->wq);
+	par->wq = NULL;
 }
 
-static struct fb_deferred_io st7789vfb_defio = {
-	.deferred_io = st7789vfb_deferred_io,
-};
-
-static struct fb_ops st7789vfb_ops = {
+static const struct fb_ops st7789vfb_ops = {
 	.owner = THIS_MODULE,
 	.fb_write = st7789vfb_write,
 	.fb_blank = st7789vfb_blank,
-	.fb_fillrect = sys_fillrect,
-	.fb_copyarea = sys_copyarea,
-	.fb_imageblit = sys_imageblit,
+	.fb_ioctl = st7789vfb_ioctl,
+#ifdef CONFIG_COMPAT
+	.fb_compat_ioctl = st7789vfb_compat_ioctl,
+#endif
+	.fb_check_var = st7789vfb_check_var,
+	.fb_set_par = st7789vfb_set_par,
+	.fb_pan_display = st7789vfb_pan_display,
+	.fb_mmap = st7789vfb_mmap,
+	.fb_fillrect = st7789vfb_fillrect,
+	.fb_copyarea = st7789vfb_copyarea,
+	.fb_imageblit = st7789vfb_imageblit,
 };
 
 static struct fb_var_screeninfo st7789vfb_var_screeninfo = {
 	.xres = SCREEN_WIDTH,
 	.yres = SCREEN_HEIGHT,
 	.xres_virtual = SCREEN_WIDTH,
-	.yres_virtual = SCREEN_HEIGHT,
+	.yres_virtual = SCREEN_YRES_VIRTUAL,
 	.bits_per_pixel = SCREEN_BPP,
 	.nonstd = 1,
 	/* RGB565 */
@@ -447,12 +3093,250 @@ static struct fb_fix_screeninfo st7789vfb_fix_screeninfo = {
 	.type = FB_TYPE_PACKED_PIXELS,
 	.visual = FB_VISUAL_PSEUDOCOLOR,
 	.xpanstep = 0,
-	.ypanstep = 0,
-	.ywrapstep = 0,
+	.ypanstep = 1,
+	.ywrapstep = 1,
 	.line_length = SCREEN_WIDTH * SCREEN_BPP / 8,
 	.accel = FB_ACCEL_NONE,
 };
 
+/* The "rotation" property is in degrees clockwise, like for other panels */
+static unsigned int st7789vfb_dt_rotate(struct device *dev)
+{
+	u32 rotation = 0;
+
+	device_property_read_u32(dev, "rotation", &rotation);
+	if (rotation % 90 || rotation >= 360) {
+		dev_warn(dev, "Unsupported rotation %u, using 0", rotation);
+		return FB_ROTATE_UR;
+	}
+
+	return rotation / 90;
+}
+
+/* The tearing effect line is optional, the panel works fine without it */
+static int st7789vfb_request_te(struct st7789vfb_par *par, struct device *dev)
+{
+	int irq;
+	int err;
+
+	init_waitqueue_head(&par->vsync_wait);
+
+	par->pin_te = devm_gpiod_get_index_optional(dev, "te", 0, GPIOD_IN);
+	if (IS_ERR(par->pin_te)) {
+		dev_err(dev, "Fail to request te GPIO");
+		return PTR_ERR(par->pin_te);
+	}
+	if (!par->pin_te)
+		return 0;
+
+	irq = gpiod_to_irq(par->pin_te);
+	if (irq < 0) {
+		dev_warn(dev, "te GPIO has no interrupt, not syncing to it");
+		par->pin_te = NULL;
+		return 0;
+	}
+
+	/* Not devm: par is released with fb_info, before devres runs */
+	err = request_irq(irq, st7789vfb_te_irq, IRQF_TRIGGER_RISING, DRV_NAME,
+			  par);
+	if (err) {
+		dev_warn(dev, "Fail to request te interrupt (%d)", err);
+		par->pin_te = NULL;
+		return 0;
+	}
+	par->te_irq = irq;
+
+	return 0;
+}
+
+static void st7789vfb_free_te(struct st7789vfb_par *par)
+{
+	if (par->pin_te)
+		free_irq(par->te_irq, par);
+}
+
+/*
+ * The SPI core maps each transfer for DMA itself, kmalloc'ed buffers are
+ * physically contiguous already and can't be premapped for it: it overwrites
+ * tx_sg and is_dma_mapped is gone from newer kernels.
+ */
+static int st7789vfb_alloc_txbufs(struct st7789vfb_par *par,
+				  struct device *dev, size_t size)
+{
+	struct st7789vfb_frame *frame;
+	int i;
+
+	par->txbuf_size = size;
+
+	/* Transmit buffers are kmalloc'ed so that they are DMA safe */
+	for (i = 0; i < ST7789VFB_FRAMES; i++) {
+		frame = par->frames[i];
+		frame->txbuf = devm_kmalloc(dev, size, GFP_KERNEL);
+		if (!frame->txbuf)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int st7789vfb_alloc_frames(struct st7789vfb_par *par,
+				  struct device *dev)
+{
+	struct st7789vfb_frame *frame;
+	int i;
+
+	mutex_init(&par->lock);
+	spin_lock_init(&par->damage_lock);
+
+	par->damage.pool = devm_kmalloc(dev, ST7789VFB_TEXT_POOL, GFP_KERNEL);
+	par->text_spare = devm_kmalloc(dev, ST7789VFB_TEXT_POOL, GFP_KERNEL);
+	par->glyphs = devm_kcalloc(dev, ST7789VFB_GLYPH_PAIRS,
+				   sizeof(*par->glyphs), GFP_KERNEL);
+	if (!par->damage.pool || !par->text_spare || !par->glyphs)
+		return -ENOMEM;
+
+	for (i = 0; i < ST7789VFB_FRAMES; i++) {
+		frame = devm_kzalloc(dev, sizeof(*frame), GFP_KERNEL);
+		if (!frame)
+			return -ENOMEM;
+
+		frame->cmdbuf = devm_kmalloc(dev, ST7789VFB_CMDBUF_SIZE,
+					     GFP_KERNEL);
+		frame->fillbuf = devm_kmalloc(
+			dev, ST7789VFB_MAX_FILLS * ST7789VFB_FILL_CHUNK,
+			GFP_KERNEL);
+		if (!frame->cmdbuf || !frame->fillbuf)
+			return -ENOMEM;
+
+		frame->par = par;
+		init_completion(&frame->done);
+		complete_all(&frame->done);
+		par->frames[i] = frame;
+	}
+
+	return 0;
+}
+
+static void st7789vfb_hist_show(struct seq_file *m, struct st7789vfb_par *par,
+				const struct st7789vfb_hist *hist)
+{
+	struct st7789vfb_hist snap;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&par->stats_lock, flags);
+	snap = *hist;
+	spin_unlock_irqrestore(&par->stats_lock, flags);
+
+	for (i = 0; i < ST7789VFB_HIST_BUCKETS; i++) {
+		if (!snap.count[i])
+			continue;
+		if (i == ST7789VFB_HIST_BUCKETS - 1)
+			seq_printf(m, "%llu-: %llu\n", 1ULL << (i - 1),
+				   snap.count[i]);
+		else
+			seq_printf(m, "%llu-%llu: %llu\n",
+				   i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1,
+				   snap.count[i]);
+	}
+}
+
+static int st7789vfb_latency_show(struct seq_file *m, void *v)
+{
+	struct st7789vfb_par *par = m->private;
+
+	st7789vfb_hist_show(m, par, &par->latency_hist);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(st7789vfb_latency);
+
+static int st7789vfb_spi_time_show(struct seq_file *m, void *v)
+{
+	struct st7789vfb_par *par = m->private;
+
+	st7789vfb_hist_show(m, par, &par->spi_hist);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(st7789vfb_spi_time);
+
+static int st7789vfb_flush_bytes_show(struct seq_file *m, void *v)
+{
+	struct st7789vfb_par *par = m->private;
+
+	st7789vfb_hist_show(m, par, &par->bytes_hist);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(st7789vfb_flush_bytes);
+
+/* Any write to "reset" clears the counters and histograms */
+static int st7789vfb_reset_set(void *data, u64 val)
+{
+	struct st7789vfb_par *par = data;
+	unsigned long flags;
+
+	mutex_lock(&par->lock);
+	par->bytes_flushed = 0;
+	par->hash_hits = 0;
+	par->hash_misses = 0;
+	mutex_unlock(&par->lock);
+
+	spin_lock_irqsave(&par->damage_lock, flags);
+	par->bytes_dirtied = 0;
+	spin_unlock_irqrestore(&par->damage_lock, flags);
+
+	spin_lock_irqsave(&par->stats_lock, flags);
+	memset(&par->latency_hist, 0, sizeof(par->latency_hist));
+	memset(&par->spi_hist, 0, sizeof(par->spi_hist));
+	memset(&par->bytes_hist, 0, sizeof(par->bytes_hist));
+	par->frames_flushed = 0;
+	par->frames_coalesced = 0;
+	par->deadline_misses = 0;
+	par->spi_errors = 0;
+	spin_unlock_irqrestore(&par->stats_lock, flags);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(st7789vfb_reset_fops, NULL, st7789vfb_reset_set,
+			 "%llu\n");
+
+static void st7789vfb_debugfs_init(struct st7789vfb_par *par)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), DRV_NAME "-%s", dev_name(&par->spi->dev));
+	par->debugfs = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(par->debugfs)) {
+		par->debugfs = NULL;
+		return;
+	}
+
+	/* Stays false when the panel init failed */
+	debugfs_create_bool("ready", 0444, par->debugfs, &par->ready);
+	debugfs_create_u64("bytes_dirtied", 0444, par->debugfs,
+			   &par->bytes_dirtied);
+	debugfs_create_u64("bytes_flushed", 0444, par->debugfs,
+			   &par->bytes_flushed);
+	debugfs_create_u64("hash_hits", 0444, par->debugfs, &par->hash_hits);
+	debugfs_create_u64("hash_misses", 0444, par->debugfs,
+			   &par->hash_misses);
+	debugfs_create_u64("frames_flushed", 0444, par->debugfs,
+			   &par->frames_flushed);
+	debugfs_create_u64("frames_coalesced", 0444, par->debugfs,
+			   &par->frames_coalesced);
+	debugfs_create_u64("deadline_misses", 0444, par->debugfs,
+			   &par->deadline_misses);
+	debugfs_create_u64("spi_errors", 0444, par->debugfs,
+			   &par->spi_errors);
+	debugfs_create_file("latency_us", 0444, par->debugfs, par,
+			    &st7789vfb_latency_fops);
+	debugfs_create_file("spi_us", 0444, par->debugfs, par,
+			    &st7789vfb_spi_time_fops);
+	debugfs_create_file("flush_bytes", 0444, par->debugfs, par,
+			    &st7789vfb_flush_bytes_fops);
+	debugfs_create_file_unsafe("reset", 0200, par->debugfs, par,
+				   &st7789vfb_reset_fops);
+}
+
 static int st7789vfb_probe(struct spi_device *spi)
 {
 	struct device *dev = &spi->dev;
@@ -460,6 +3344,7 @@ static int st7789vfb_probe(struct spi_device *spi)
 	struct fb_info *info = NULL;
 	u8 *vmem = NULL;
 	int vmem_size = 0;
+	int gram_size = 0;
 	int err = 0;
 
 	dev_dbg(dev, "%s\n", __func__);
@@ -469,8 +3354,10 @@ static int st7789vfb_probe(struct spi_device *spi)
 	if (err < 0)
 		return err;
 
-	vmem_size = SCREEN_HEIGHT * SCREEN_WIDTH * SCREEN_BPP / 8;
-	vmem = vzalloc(vmem_size);
+	vmem_size = SCREEN_YRES_VIRTUAL * SCREEN_WIDTH * SCREEN_BPP / 8;
+	gram_size = SCREEN_HEIGHT * SCREEN_WIDTH * SCREEN_BPP / 8;
+	/* vmalloc_user() so that untracked mappings can map it directly */
+	vmem = vmalloc_user(vmem_size);
 	if (!vmem) {
 		return -ENOMEM;
 	}
@@ -483,32 +3370,52 @@ static int st7789vfb_probe(struct spi_device *spi)
 	}
 
 	par = info->par;
+
+	err = st7789vfb_alloc_frames(par, dev);
+	if (err < 0)
+		goto frames_alloc_error;
+
 	dev_info(
 		dev,
 		"Sagemcom fbdev driver for Sitronix st7789v on bcm63xx %u.%u.%u",
 		VERSION_MAJOR, VERSION_MINOR, VERSION_MICRO);
 
-	info->flags = FBINFO_FLAG_DEFAULT | FBINFO_VIRTFB;
-	info->fbops = &st7789vfb_ops;
+	info->flags = FBINFO_FLAG_DEFAULT | FBINFO_VIRTFB | FBINFO_READS_FAST |
+		      FBINFO_HWACCEL_YPAN | FBINFO_HWACCEL_YWRAP;
+	par->fbops = st7789vfb_ops;
+	info->fbops = &par->fbops;
 	info->var = st7789vfb_var_screeninfo;
 	info->fix = st7789vfb_fix_screeninfo;
 
-	info->fbdefio = &st7789vfb_defio;
-	info->fbdefio->delay = HZ / SCREEN_FPS;
+	par->rotate = st7789vfb_dt_rotate(dev);
+	info->var.rotate = par->rotate;
+	st7789vfb_rotate_var(&info->var);
+	st7789vfb_rotate_fix(info);
+
+	par->fps = clamp_t(uint, fps, ST7789VFB_FPS_MIN, ST7789VFB_FPS_MAX);
+	par->adaptive = adaptive;
+	spin_lock_init(&par->stats_lock);
+	par->win_start = ktime_get();
+
+	par->priority = ST7789VFB_PRIO_DEFAULT;
+
+	st7789vfb_forget_state(par);
+	INIT_WORK(&par->init_work, st7789vfb_init_work);
+	INIT_WORK(&par->flush_work, st7789vfb_flush_work);
+	init_completion(&par->init_done);
+
+	/* Each panel has its own deferred io, with its own rate */
+	par->defio.delay = max(1U, HZ / par->fps);
+	par->defio.first_io = st7789vfb_first_io;
+	par->defio.deferred_io = st7789vfb_deferred_io;
+	info->fbdefio = &par->defio;
 
 	info->screen_base = vmem;
 	info->fix.smem_start = (unsigned long)vmem;
 	info->fix.smem_len = vmem_size;
 
-	fb_deferred_io_init(info);
-
 	par->info = info;
-
-	err = register_framebuffer(info);
-	if (err) {
-		dev_err(&spi->dev, "Could not register the framebuffer\n");
-		goto fb_register_error;
-	}
+	par->kms = kms;
 
 	par->pin_bl = devm_gpiod_get_index(dev, "backlight", 0, GPIOD_OUT_HIGH);
 	if (IS_ERR(par->pin_bl)) {
@@ -529,20 +3436,70 @@ static int st7789vfb_probe(struct spi_device *spi)
 		goto error;
 	}
 
-	par->pin_dc = devm_gpiod_get_index(dev, "datacom", 0, GPIOD_OUT_LOW);
+	par->pin_dc = devm_gpiod_get_optional(dev, "datacom", GPIOD_OUT_LOW);
 	if (IS_ERR(par->pin_dc)) {
 		dev_err(dev, "Fail to request datacom GPIO");
 		err = PTR_ERR(par->pin_dc);
 		goto error;
 	}
 
+	/* No DC line, fall back to the 3-line serial interface */
+	if (!par->pin_dc) {
+		if (spi->master->bits_per_word_mask &&
+		    !(spi->master->bits_per_word_mask & SPI_BPW_MASK(9))) {
+			dev_err(dev, "No datacom GPIO and no 9 bit SPI words");
+			err = -EINVAL;
+			goto error;
+		}
+
+		par->buf9 = devm_kmalloc(dev, ST7789VFB_BUF9_WORDS * 2,
+					 GFP_KERNEL);
+		if (!par->buf9) {
+			err = -ENOMEM;
+			goto error;
+		}
+		par->wire9 = true;
+		dev_info(dev, "No datacom GPIO, sending 9 bit words");
+	}
+
+	err = st7789vfb_request_te(par, dev);
+	if (err < 0)
+		goto error;
+
 	par->spi = spi;
 
-	err = st7789vfb_setup_display(par);
-	if (err < 0) {
-		dev_err(dev, "failed to setup display");
+	err = st7789vfb_bus_get(par);
+	if (err < 0)
 		goto error;
+
+	/* Some controller can restrict the max transfer size
+	 * in that case, split message in chunk
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	if (spi->master->max_transfer_size != NULL) {
+		par->max_xfer = spi->master->max_transfer_size(spi);
+	} else {
+		par->max_xfer = gram_size;
 	}
+#else
+	par->max_xfer = gram_size;
+#endif
+
+	/* Only one screen worth of lines is ever in flight */
+	err = st7789vfb_alloc_txbufs(par, dev,
+				     st7789vfb_mem_len(par, gram_size));
+	if (err < 0)
+		goto error;
+
+	/* Frames are chained from SPI completion, where DC can't sleep */
+	par->async = !par->pin_dc || !gpiod_cansleep(par->pin_dc);
+
+	err = st7789vfb_flush_wq_start(par, dev);
+	if (err < 0)
+		goto error;
+
+	/* Up before the framebuffer, fbcon may blank it while registering */
+	queue_work(system_unbound_wq, &par->init_work);
 
 	dev_set_drvdata(dev, info);
 
@@ -551,16 +3508,60 @@ static int st7789vfb_probe(struct spi_device *spi)
 		err = device_create_file(dev, &dev_attr_bl_status);
 		if (err) {
 			dev_err(dev, "Fail to add bl_status file\n");
-			goto error;
+			goto init_error;
+		}
+	}
+
+	err = sysfs_create_group(&dev->kobj, &st7789vfb_attr_group);
+	if (err) {
+		dev_err(dev, "Fail to add rate files\n");
+		goto attr_error;
+	}
+
+	if (par->kms) {
+		par->drm = st7789vfb_drm_init(par, dev, info->var.xres,
+					      info->var.yres);
+		if (IS_ERR(par->drm)) {
+			err = PTR_ERR(par->drm);
+			dev_err(dev, "Fail to register DRM device (%d)\n", err);
+			goto group_error;
+		}
+	}
+
+	/* With the DRM front end fb_info only describes vmem */
+	if (!par->kms) {
+		fb_deferred_io_init(info);
+		/* Older deferred io installs its own mmap, ours hands over to it */
+		par->fbops.fb_mmap = st7789vfb_mmap;
+
+		err = register_framebuffer(info);
+		if (err) {
+			dev_err(&spi->dev,
+				"Could not register the framebuffer\n");
+			goto fb_register_error;
 		}
 	}
 
+	st7789vfb_debugfs_init(par);
+
 	return 0;
 
-error:
-	unregister_framebuffer(info);
 fb_register_error:
 	fb_deferred_io_cleanup(info);
+group_error:
+	sysfs_remove_group(&dev->kobj, &st7789vfb_attr_group);
+attr_error:
+	if (!IS_ERR_OR_NULL(par->pin_bl)) {
+		device_remove_file(dev, &dev_attr_bl_status);
+	}
+init_error:
+	cancel_work_sync(&par->init_work);
+	st7789vfb_wait_idle(par);
+	st7789vfb_flush_wq_stop(par);
+error:
+	st7789vfb_free_te(par);
+	st7789vfb_bus_put(par);
+frames_alloc_error:
 	framebuffer_release(info);
 fb_alloc_error:
 	vfree(vmem);
@@ -572,14 +3573,32 @@ static int st7789vfb_remove(struct spi_device *spi)
 {
 	struct fb_info *info = dev_get_drvdata(&spi->dev);
 	struct st7789vfb_par *par = info->par;
+	bool ready;
 
+	debugfs_remove_recursive(par->debugfs);
+	sysfs_remove_group(&spi->dev.kobj, &st7789vfb_attr_group);
 	if (!IS_ERR_OR_NULL(par->pin_bl)) {
 		device_remove_file(&spi->dev, &dev_attr_bl_status);
 	}
-	st7789vfb_teardown_display(par);
-
-	unregister_framebuffer(info);
-	fb_deferred_io_cleanup(info);
+	/* Init may not have run at all, nobody must wait for it from here on */
+	cancel_work_sync(&par->init_work);
+	complete_all(&par->init_done);
+	if (par->kms)
+		st7789vfb_drm_fini(par->drm);
+	mutex_lock(&par->lock);
+	ready = par->ready;
+	mutex_unlock(&par->lock);
+	if (ready)
+		st7789vfb_teardown_display(par);
+
+	if (!par->kms) {
+		unregister_framebuffer(info);
+		fb_deferred_io_cleanup(info);
+	}
+	st7789vfb_flush_wq_stop(par);
+	st7789vfb_wait_idle(par);
+	st7789vfb_free_te(par);
+	st7789vfb_bus_put(par);
 	vfree(info->screen_base);
 	framebuffer_release(info);
 
@@ -609,7 +3628,11 @@ static struct spi_driver st7789vfb_driver = {
 		{
 			.name = DRV_NAME,
 			.of_match_table = st7789vfb_match,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+			.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 		},
+	.id_table = st7789vfb_ids,
 	.probe = st7789vfb_probe,
 	.remove = st7789vfb_remove,
 };
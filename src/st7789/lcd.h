@@ -0,0 +1,41 @@
+#ifndef __ST7789VFB_LCD_H__
+#define __ST7789VFB_LCD_H__
+
+#include <linux/err.h>
+#include <linux/kconfig.h>
+#include <linux/types.h>
+
+struct device;
+struct st7789vfb_drm;
+struct st7789vfb_par;
+
+/* Panel core in lcd.c, shared by the fbdev and the DRM front ends */
+u8 *st7789vfb_vmem(struct st7789vfb_par *par, unsigned int *pitch);
+void st7789vfb_update_display(struct st7789vfb_par *par,
+			      unsigned int start_line, unsigned int end_line);
+void st7789vfb_update_rect(struct st7789vfb_par *par, unsigned int x,
+			   unsigned int y, unsigned int width,
+			   unsigned int height);
+void st7789vfb_power(struct st7789vfb_par *par, bool on);
+
+/* DRM front end in drm.c */
+#if IS_ENABLED(CONFIG_DRM_KMS_HELPER)
+struct st7789vfb_drm *st7789vfb_drm_init(struct st7789vfb_par *par,
+					 struct device *dev,
+					 unsigned int width,
+					 unsigned int height);
+void st7789vfb_drm_fini(struct st7789vfb_drm *sdrm);
+#else
+static inline struct st7789vfb_drm *
+st7789vfb_drm_init(struct st7789vfb_par *par, struct device *dev,
+		   unsigned int width, unsigned int height)
+{
+	return ERR_PTR(-ENODEV);
+}
+
+static inline void st7789vfb_drm_fini(struct st7789vfb_drm *sdrm)
+{
+}
+#endif
+
+#endif
@@ -0,0 +1,231 @@
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/errno.h>
+#include <linux/gpio/driver.h>
+#include <linux/gpio/machine.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/spi/spi.h>
+
+#include "version.h"
+
+/*
+ * Stand-in SPI controller and GPIO chip to run st7789vfb without a panel.
+ * Transfers are dropped after the time they would take on a real bus, so
+ * frame rates and latencies still mean something. The panel GPIOs are
+ * served by a small chip that only remembers its line values.
+ */
+
+#define DRV_NAME "st7789_dummy"
+
+enum {
+	ST7789_DUMMY_BACKLIGHT,
+	ST7789_DUMMY_POWER,
+	ST7789_DUMMY_RESET,
+	ST7789_DUMMY_DATACOM,
+	ST7789_DUMMY_NGPIO,
+};
+
+static uint speed_hz = 32000000;
+module_param(speed_hz, uint, 0444);
+MODULE_PARM_DESC(speed_hz, "Simulated SPI clock in Hz, 0 completes at once");
+
+static bool three_wire;
+module_param(three_wire, bool, 0444);
+MODULE_PARM_DESC(three_wire, "No DC line, the panel sends 9 bit words instead");
+
+struct st7789_dummy {
+	struct gpio_chip gc;
+	unsigned long values;
+	struct gpiod_lookup_table *lookup;
+	struct spi_device *spi;
+};
+
+static struct platform_device *st7789_dummy_pdev;
+
+static int st7789_dummy_get(struct gpio_chip *gc, unsigned int offset)
+{
+	struct st7789_dummy *priv = gpiochip_get_data(gc);
+
+	return test_bit(offset, &priv->values);
+}
+
+static void st7789_dummy_set(struct gpio_chip *gc, unsigned int offset,
+			     int value)
+{
+	struct st7789_dummy *priv = gpiochip_get_data(gc);
+
+	assign_bit(offset, &priv->values, value);
+}
+
+static int st7789_dummy_direction_input(struct gpio_chip *gc,
+					unsigned int offset)
+{
+	return 0;
+}
+
+static int st7789_dummy_direction_output(struct gpio_chip *gc,
+					 unsigned int offset, int value)
+{
+	st7789_dummy_set(gc, offset, value);
+	return 0;
+}
+
+static int st7789_dummy_transfer_one(struct spi_master *master,
+				     struct spi_device *spi,
+				     struct spi_transfer *xfer)
+{
+	u32 hz = xfer->speed_hz ? xfer->speed_hz : speed_hz;
+	u64 bits = (u64)xfer->len * 8;
+	u64 ns;
+
+	if (!hz)
+		return 0;
+
+	/* Words wider than a byte are stored in two */
+	if (xfer->bits_per_word > 8)
+		bits = (u64)xfer->len / 2 * xfer->bits_per_word;
+
+	ns = div_u64(bits * NSEC_PER_SEC, hz);
+	if (ns >= 20 * NSEC_PER_USEC)
+		usleep_range(div_u64(ns, NSEC_PER_USEC),
+			     div_u64(ns, NSEC_PER_USEC) + 10);
+	else
+		ndelay(ns);
+
+	return 0;
+}
+
+static int st7789_dummy_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct spi_board_info info = {
+		.modalias = "st7789bfb",
+		.max_speed_hz = speed_hz,
+		.mode = SPI_MODE_3,
+	};
+	struct st7789_dummy *priv;
+	struct spi_master *master;
+	int err;
+
+	master = devm_spi_alloc_master(dev, sizeof(*priv));
+	if (!master)
+		return -ENOMEM;
+
+	priv = spi_master_get_devdata(master);
+	platform_set_drvdata(pdev, priv);
+
+	priv->gc.label = DRV_NAME;
+	priv->gc.parent = dev;
+	priv->gc.owner = THIS_MODULE;
+	priv->gc.base = -1;
+	priv->gc.ngpio = ST7789_DUMMY_NGPIO;
+	priv->gc.get = st7789_dummy_get;
+	priv->gc.set = st7789_dummy_set;
+	priv->gc.direction_input = st7789_dummy_direction_input;
+	priv->gc.direction_output = st7789_dummy_direction_output;
+
+	err = devm_gpiochip_add_data(dev, &priv->gc, priv);
+	if (err) {
+		dev_err(dev, "Fail to add GPIO chip (%d)", err);
+		return err;
+	}
+
+	master->bus_num = -1;
+	master->num_chipselect = 1;
+	master->mode_bits = SPI_CPOL | SPI_CPHA;
+	master->bits_per_word_mask = SPI_BPW_MASK(8) | SPI_BPW_MASK(9);
+	master->max_speed_hz = speed_hz ? speed_hz : U32_MAX;
+	master->transfer_one = st7789_dummy_transfer_one;
+
+	err = devm_spi_register_master(dev, master);
+	if (err) {
+		dev_err(dev, "Fail to register SPI master (%d)", err);
+		return err;
+	}
+
+	/* The lookup has to be in place before the panel device probes */
+	priv->lookup = devm_kzalloc(
+		dev, struct_size(priv->lookup, table, ST7789_DUMMY_NGPIO + 1),
+		GFP_KERNEL);
+	if (!priv->lookup)
+		return -ENOMEM;
+
+	priv->lookup->dev_id =
+		devm_kasprintf(dev, GFP_KERNEL, "spi%d.0", master->bus_num);
+	if (!priv->lookup->dev_id)
+		return -ENOMEM;
+
+	priv->lookup->table[0] = (struct gpiod_lookup)GPIO_LOOKUP(
+		DRV_NAME, ST7789_DUMMY_BACKLIGHT, "backlight", 0);
+	priv->lookup->table[1] = (struct gpiod_lookup)GPIO_LOOKUP(
+		DRV_NAME, ST7789_DUMMY_POWER, "power", 0);
+	priv->lookup->table[2] = (struct gpiod_lookup)GPIO_LOOKUP(
+		DRV_NAME, ST7789_DUMMY_RESET, "reset", 0);
+	if (!three_wire)
+		priv->lookup->table[3] = (struct gpiod_lookup)GPIO_LOOKUP(
+			DRV_NAME, ST7789_DUMMY_DATACOM, "datacom", 0);
+	gpiod_add_lookup_table(priv->lookup);
+
+	priv->spi = spi_new_device(master, &info);
+	if (!priv->spi) {
+		dev_err(dev, "Fail to add panel device");
+		gpiod_remove_lookup_table(priv->lookup);
+		return -ENODEV;
+	}
+
+	dev_info(dev, "Stand-in for st7789vfb on %s at %u Hz",
+		 dev_name(&priv->spi->dev), speed_hz);
+
+	return 0;
+}
+
+static int st7789_dummy_remove(struct platform_device *pdev)
+{
+	struct st7789_dummy *priv = platform_get_drvdata(pdev);
+
+	spi_unregister_device(priv->spi);
+	gpiod_remove_lookup_table(priv->lookup);
+
+	return 0;
+}
+
+static struct platform_driver st7789_dummy_driver = {
+	.driver = {
+		.name = DRV_NAME,
+	},
+	.probe = st7789_dummy_probe,
+	.remove = st7789_dummy_remove,
+};
+
+static int __init st7789_dummy_init(void)
+{
+	int err;
+
+	err = platform_driver_register(&st7789_dummy_driver);
+	if (err)
+		return err;
+
+	st7789_dummy_pdev = platform_device_register_simple(DRV_NAME, -1,
+							    NULL, 0);
+	if (IS_ERR(st7789_dummy_pdev)) {
+		platform_driver_unregister(&st7789_dummy_driver);
+		return PTR_ERR(st7789_dummy_pdev);
+	}
+
+	return 0;
+}
+module_init(st7789_dummy_init);
+
+static void __exit st7789_dummy_exit(void)
+{
+	platform_device_unregister(st7789_dummy_pdev);
+	platform_driver_unregister(&st7789_dummy_driver);
+}
+module_exit(st7789_dummy_exit);
+
+MODULE_DESCRIPTION("Stand-in SPI controller and GPIOs for st7789vfb");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(VERSION);
@@ -0,0 +1,42 @@
+#ifndef __ST7789VFB_H__
+#define __ST7789VFB_H__
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Interface of st7789vfb beyond the fbdev one, shared with userspace.
+ *
+ * Writes through an mmap of the framebuffer are found by write protecting its
+ * pages and are flushed after the deferred io delay. Clients that know what
+ * they drew can map at ST7789VFB_MMAP_UNTRACKED instead, which costs no page
+ * faults, and report what they changed with ST7789VFB_IOCTL_DIRTY, which
+ * flushes it right away. The ioctl works on tracked mappings too.
+ */
+
+/* mmap offset of the framebuffer without write tracking */
+#define ST7789VFB_MMAP_UNTRACKED 0x40000000
+
+/* Dirty area, in pixels and lines of the virtual resolution */
+struct st7789vfb_dirty_rect {
+	__u32 x;
+	__u32 y;
+	__u32 width;
+	__u32 height;
+};
+
+/* Return once the rectangles are on the panel */
+#define ST7789VFB_DIRTY_WAIT (1 << 0)
+
+#define ST7789VFB_DIRTY_MAX 64
+
+struct st7789vfb_dirty {
+	/* User pointer to nrects struct st7789vfb_dirty_rect */
+	__u64 rects;
+	__u32 nrects;
+	__u32 flags;
+};
+
+#define ST7789VFB_IOCTL_DIRTY _IOW('F', 0xC0, struct st7789vfb_dirty)
+
+#endif
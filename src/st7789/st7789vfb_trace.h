@@ -0,0 +1,195 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM st7789vfb
+
+#if !defined(__ST7789VFB_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __ST7789VFB_TRACE_H__
+
+#include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+/*
+ * Tracepoints of the flush and transfer path, in events/st7789vfb of tracefs.
+ * Disabled they are a patched out branch each, they stay built in. lcd.c
+ * defines them, it needs -I$(src) for define_trace.h to find this file.
+ */
+
+#ifndef st7789vfb_assign_dev
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define st7789vfb_assign_dev(d) __assign_str(dev)
+#else
+#define st7789vfb_assign_dev(d) __assign_str(dev, dev_name(d))
+#endif
+#endif
+
+/* Damage taken by a flush */
+TRACE_EVENT(st7789vfb_flush_start,
+	TP_PROTO(struct device *d, unsigned int nrects, unsigned int nfills,
+		 unsigned int ntexts, unsigned int updates, bool scroll),
+	TP_ARGS(d, nrects, nfills, ntexts, updates, scroll),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(d))
+		__field(unsigned int, nrects)
+		__field(unsigned int, nfills)
+		__field(unsigned int, ntexts)
+		__field(unsigned int, updates)
+		__field(bool, scroll)
+	),
+	TP_fast_assign(
+		st7789vfb_assign_dev(d);
+		__entry->nrects = nrects;
+		__entry->nfills = nfills;
+		__entry->ntexts = ntexts;
+		__entry->updates = updates;
+		__entry->scroll = scroll;
+	),
+	TP_printk("%s rects=%u fills=%u texts=%u updates=%u scroll=%d",
+		  __get_str(dev), __entry->nrects, __entry->nfills,
+		  __entry->ntexts, __entry->updates, __entry->scroll)
+);
+
+/* Pixel data the flush queued, commands not counted */
+TRACE_EVENT(st7789vfb_flush_end,
+	TP_PROTO(struct device *d, u64 bytes),
+	TP_ARGS(d, bytes),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(d))
+		__field(u64, bytes)
+	),
+	TP_fast_assign(
+		st7789vfb_assign_dev(d);
+		__entry->bytes = bytes;
+	),
+	TP_printk("%s bytes=%llu", __get_str(dev), __entry->bytes)
+);
+
+/* Area of GRAM written next, in memory rows */
+TRACE_EVENT(st7789vfb_window,
+	TP_PROTO(struct device *d, int xs, int ys, int xe, int ye),
+	TP_ARGS(d, xs, ys, xe, ye),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(d))
+		__field(int, xs)
+		__field(int, ys)
+		__field(int, xe)
+		__field(int, ye)
+	),
+	TP_fast_assign(
+		st7789vfb_assign_dev(d);
+		__entry->xs = xs;
+		__entry->ys = ys;
+		__entry->xe = xe;
+		__entry->ye = ye;
+	),
+	TP_printk("%s xs=%d ys=%d xe=%d ye=%d", __get_str(dev), __entry->xs,
+		  __entry->ys, __entry->xe, __entry->ye)
+);
+
+/*
+ * A command queued into a frame, with len bytes of parameters, or sent on its
+ * own, with len 0 and the parameters following separately
+ */
+TRACE_EVENT(st7789vfb_cmd,
+	TP_PROTO(struct device *d, u8 cmd, size_t len, bool queued),
+	TP_ARGS(d, cmd, len, queued),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(d))
+		__field(u8, cmd)
+		__field(size_t, len)
+		__field(bool, queued)
+	),
+	TP_fast_assign(
+		st7789vfb_assign_dev(d);
+		__entry->cmd = cmd;
+		__entry->len = len;
+		__entry->queued = queued;
+	),
+	TP_printk("%s cmd=0x%02x len=%zu %s", __get_str(dev), __entry->cmd,
+		  __entry->len, __entry->queued ? "queued" : "sync")
+);
+
+/* A frame handed to the SPI controller */
+TRACE_EVENT(st7789vfb_frame_submit,
+	TP_PROTO(struct device *d, unsigned int nsegs, unsigned int nxfers,
+		 size_t bytes),
+	TP_ARGS(d, nsegs, nxfers, bytes),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(d))
+		__field(unsigned int, nsegs)
+		__field(unsigned int, nxfers)
+		__field(size_t, bytes)
+	),
+	TP_fast_assign(
+		st7789vfb_assign_dev(d);
+		__entry->nsegs = nsegs;
+		__entry->nxfers = nxfers;
+		__entry->bytes = bytes;
+	),
+	TP_printk("%s segs=%u xfers=%u bytes=%zu", __get_str(dev),
+		  __entry->nsegs, __entry->nxfers, __entry->bytes)
+);
+
+/* The frame left the bus, frames go out one at a time and in order */
+TRACE_EVENT(st7789vfb_frame_done,
+	TP_PROTO(struct device *d, int status, u64 busy_ns),
+	TP_ARGS(d, status, busy_ns),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(d))
+		__field(int, status)
+		__field(u64, busy_ns)
+	),
+	TP_fast_assign(
+		st7789vfb_assign_dev(d);
+		__entry->status = status;
+		__entry->busy_ns = busy_ns;
+	),
+	TP_printk("%s status=%d busy_ns=%llu", __get_str(dev),
+		  __entry->status, __entry->busy_ns)
+);
+
+/* First write through mmap, the deferred io work is scheduled for it */
+TRACE_EVENT(st7789vfb_first_io,
+	TP_PROTO(struct device *d, unsigned long delay),
+	TP_ARGS(d, delay),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(d))
+		__field(unsigned long, delay)
+	),
+	TP_fast_assign(
+		st7789vfb_assign_dev(d);
+		__entry->delay = delay;
+	),
+	TP_printk("%s delay=%lu", __get_str(dev), __entry->delay)
+);
+
+/* The deferred io work runs, wait_us since the first update it takes */
+TRACE_EVENT(st7789vfb_deferred_io,
+	TP_PROTO(struct device *d, unsigned int pages, unsigned int updates,
+		 ktime_t since),
+	TP_ARGS(d, pages, updates, since),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(d))
+		__field(unsigned int, pages)
+		__field(unsigned int, updates)
+		__field(s64, wait_us)
+	),
+	TP_fast_assign(
+		st7789vfb_assign_dev(d);
+		__entry->pages = pages;
+		__entry->updates = updates;
+		__entry->wait_us = updates ?
+			ktime_us_delta(ktime_get(), since) : 0;
+	),
+	TP_printk("%s pages=%u updates=%u wait_us=%lld", __get_str(dev),
+		  __entry->pages, __entry->updates, __entry->wait_us)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE st7789vfb_trace
+
+#include <trace/define_trace.h>